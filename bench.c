@@ -0,0 +1,487 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Generate a synthetic corpus of HTML5 pages and a catalog for them,
+ * then time sintl extracting, joining, and updating with them.
+ * This isn't installed: it's run by "make bench".
+ */
+
+/*
+ * Shape of the generated corpus.
+ */
+struct	corpus {
+	size_t		 pages; /* number of pages */
+	size_t		 pagesz; /* approximate bytes per page */
+	size_t		 depth; /* nesting of blocks */
+	size_t		 phrasing; /* percent of words in phrasing */
+	size_t		 filler; /* extra catalog units */
+	size_t		 repeat; /* percent of repeated segments */
+	uint64_t	 seed; /* random seed */
+	size_t		 bytes; /* total bytes of pages */
+	size_t		 segs; /* total segments in pages */
+	size_t		 uniq; /* unique segment counter */
+};
+
+#define	POOLSZ	64
+
+static	const char *const words[] = {
+	"the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+	"translation", "segment", "catalog", "page", "with", "some",
+	"text", "and", "markup", "inside", "of", "it", "for", "testing",
+	"throughput", "when", "joining", "extracting", "updating",
+};
+
+#define	WORDSZ	(sizeof(words) / sizeof(words[0]))
+
+static	char	*pool[POOLSZ];
+
+static uint64_t
+rnd(struct corpus *c)
+{
+
+	/* xorshift64*: fine for generating text. */
+
+	c->seed ^= c->seed >> 12;
+	c->seed ^= c->seed << 25;
+	c->seed ^= c->seed >> 27;
+	return c->seed * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * Write a sentence of "n" words, some within phrasing elements, into a
+ * new string.
+ * If "uniq" is non-zero, it's worked into the sentence.
+ */
+static char *
+sentence(struct corpus *c, size_t n, size_t uniq)
+{
+	char	*buf = NULL;
+	size_t	 i, bufsz = 0;
+	FILE	*f;
+	const char *w;
+
+	if (NULL == (f = open_memstream(&buf, &bufsz)))
+		err(EXIT_FAILURE, NULL);
+
+	for (i = 0; i < n; i++) {
+		if (i > 0)
+			putc(' ', f);
+		w = words[rnd(c) % WORDSZ];
+		if (uniq && i == n / 2) {
+			fprintf(f, "u%zu", uniq);
+			continue;
+		}
+		if (rnd(c) % 100 >= c->phrasing) {
+			fputs(w, f);
+			continue;
+		}
+		switch (rnd(c) % 5) {
+		case 0:
+			fprintf(f, "<b>%s</b>", w);
+			break;
+		case 1:
+			fprintf(f, "<em>%s</em>", w);
+			break;
+		case 2:
+			fprintf(f, "<a href=\"#%s\">%s</a>", w, w);
+			break;
+		case 3:
+			fprintf(f, "<code>%s</code>", w);
+			break;
+		default:
+			fprintf(f, "%s <img src=\"%s.png\" "
+				"alt=\"%s\" />", w, w, w);
+			break;
+		}
+	}
+
+	if (EOF == fclose(f))
+		err(EXIT_FAILURE, NULL);
+	return buf;
+}
+
+/*
+ * Emit a single segment, either from the pool of repeated sentences
+ * or unique to this corpus.
+ */
+static void
+segment(struct corpus *c, FILE *f, const char *elem)
+{
+	char	*s;
+
+	c->segs++;
+	if (rnd(c) % 100 < c->repeat) {
+		fprintf(f, "<%s>%s</%s>\n",
+			elem, pool[rnd(c) % POOLSZ], elem);
+		return;
+	}
+	s = sentence(c, 6 + rnd(c) % 20, ++c->uniq);
+	fprintf(f, "<%s>%s</%s>\n", elem, s, elem);
+	free(s);
+}
+
+static void
+page(struct corpus *c, const char *fn, size_t num)
+{
+	FILE	*f;
+	size_t	 i;
+	long	 sz;
+
+	if (NULL == (f = fopen(fn, "w")))
+		err(EXIT_FAILURE, "%s", fn);
+
+	fprintf(f, "<!DOCTYPE html>\n"
+		"<html xmlns:its=\"http://www.w3.org/2005/11/its\" "
+		"lang=\"en\">\n"
+		"<head>\n"
+		"<meta charset=\"utf-8\" />\n"
+		"<title>Page %zu</title>\n"
+		"</head>\n"
+		"<body>\n"
+		"<nav its:translate=\"no\"><a href=\"/\">home</a></nav>\n",
+		num);
+	c->segs++;
+
+	while ((sz = ftell(f)) >= 0 && (size_t)sz < c->pagesz) {
+		for (i = 0; i < c->depth; i++)
+			fprintf(f, "<div class=\"d%zu\">\n", i);
+		segment(c, f, "h2");
+		for (i = 0; i < 4; i++)
+			segment(c, f, "p");
+		fputs("<pre xml:space=\"preserve\">  keep   this\n"
+		      "  spacing  </pre>\n", f);
+		c->segs++;
+		for (i = 0; i < c->depth; i++)
+			fputs("</div>\n", f);
+	}
+
+	fputs("</body>\n</html>\n", f);
+	if (-1 == (sz = ftell(f)))
+		err(EXIT_FAILURE, "%s", fn);
+	c->bytes += sz;
+	if (EOF == fclose(f))
+		err(EXIT_FAILURE, "%s", fn);
+}
+
+/*
+ * A page with "filler" unique segments, used only to pad the catalog.
+ */
+static void
+filler(struct corpus *c, const char *fn)
+{
+	FILE	*f;
+	size_t	 i;
+	char	*s;
+
+	if (NULL == (f = fopen(fn, "w")))
+		err(EXIT_FAILURE, "%s", fn);
+
+	fputs("<!DOCTYPE html>\n"
+	      "<html xmlns:its=\"http://www.w3.org/2005/11/its\" "
+	      "lang=\"en\">\n"
+	      "<body>\n", f);
+	for (i = 0; i < c->filler; i++) {
+		s = sentence(c, 10, ++c->uniq);
+		fprintf(f, "<p>%s</p>\n", s);
+		free(s);
+	}
+	fputs("</body>\n</html>\n", f);
+
+	if (EOF == fclose(f))
+		err(EXIT_FAILURE, "%s", fn);
+}
+
+/*
+ * Run "argv", with standard output into "out" (or /dev/null).
+ * Fills in the wall-clock time and peak RSS (KB).
+ */
+static void
+run(const char *argv[], const char *out, double *secs, long *rss)
+{
+	pid_t		 pid;
+	int		 st, fd;
+	struct rusage	 ru;
+	struct timespec	 t0, t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	if (-1 == (pid = fork()))
+		err(EXIT_FAILURE, "fork");
+
+	if (0 == pid) {
+		if (NULL == out)
+			out = "/dev/null";
+		fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (-1 == fd)
+			err(EXIT_FAILURE, "%s", out);
+		if (-1 == dup2(fd, STDOUT_FILENO))
+			err(EXIT_FAILURE, "dup2");
+		execv(argv[0], (char *const *)argv);
+		err(EXIT_FAILURE, "%s", argv[0]);
+	}
+
+	if (-1 == wait4(pid, &st, 0, &ru))
+		err(EXIT_FAILURE, "wait4");
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if ( ! WIFEXITED(st) || 0 != WEXITSTATUS(st))
+		errx(EXIT_FAILURE, "%s: failed", argv[0]);
+
+	*secs = (t1.tv_sec - t0.tv_sec) +
+		(t1.tv_nsec - t0.tv_nsec) / 1e9;
+#ifdef __APPLE__
+	*rss = ru.ru_maxrss / 1024;
+#else
+	*rss = ru.ru_maxrss;
+#endif
+}
+
+/*
+ * Run the mode in "argv" "iters" times, reporting the best time and
+ * the largest peak RSS.
+ */
+static void
+bench(const struct corpus *c, const char *name,
+	const char *argv[], size_t iters)
+{
+	size_t	 i;
+	double	 secs, best = 0.0;
+	long	 rss, maxrss = 0;
+
+	for (i = 0; i < iters; i++) {
+		run(argv, NULL, &secs, &rss);
+		if (0 == i || secs < best)
+			best = secs;
+		if (rss > maxrss)
+			maxrss = rss;
+	}
+
+	if (best <= 0.0)
+		best = 1e-9;
+
+	printf("%-6s %10.3f %10.2f %12.0f %12ld\n", name, best,
+		c->bytes / best / (1024.0 * 1024.0),
+		c->segs / best, maxrss);
+}
+
+static size_t
+num(const char *arg, long long max)
+{
+	const char	*er;
+	size_t		 v;
+
+	v = strtonum(arg, 0, max, &er);
+	if (NULL != er)
+		errx(EXIT_FAILURE, "%s: %s", arg, er);
+	return v;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct corpus	 c;
+	int		 ch, keep = 0;
+	size_t		 i, iters = 3, n;
+	char		 dir[] = "/tmp/sintl-bench.XXXXXXXXXX";
+	char		*cat, *ccat, *fill;
+	const char	*sintl = "./sintl", *jobs = NULL;
+	char		**pages;
+	const char	**av;
+	double		 secs;
+	long		 rss;
+
+	memset(&c, 0, sizeof(struct corpus));
+	c.pages = 200;
+	c.pagesz = 32 * 1024;
+	c.depth = 4;
+	c.phrasing = 20;
+	c.filler = 1000;
+	c.repeat = 50;
+	c.seed = 0x5eed;
+
+	while (-1 != (ch = getopt(argc, argv, "c:d:i:kn:p:P:r:S:s:x:")))
+		switch (ch) {
+		case 'c':
+			c.filler = num(optarg, 10000000);
+			break;
+		case 'd':
+			c.depth = num(optarg, 32);
+			break;
+		case 'i':
+			iters = num(optarg, 1000);
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 'n':
+			c.pages = num(optarg, 1000000);
+			break;
+		case 'p':
+			c.phrasing = num(optarg, 100);
+			break;
+		case 'P':
+			num(optarg, 1024);
+			jobs = optarg;
+			break;
+		case 'r':
+			c.repeat = num(optarg, 100);
+			break;
+		case 'S':
+			c.seed = num(optarg, LLONG_MAX) | 1;
+			break;
+		case 's':
+			c.pagesz = num(optarg, 1024 * 1024 * 1024);
+			break;
+		case 'x':
+			sintl = optarg;
+			break;
+		default:
+			goto usage;
+		}
+
+	if (optind != argc || 0 == c.pages || 0 == iters)
+		goto usage;
+
+	if (NULL == mkdtemp(dir))
+		err(EXIT_FAILURE, "%s", dir);
+
+	/* Generate the corpus. */
+
+	for (i = 0; i < POOLSZ; i++)
+		pool[i] = sentence(&c, 6 + rnd(&c) % 20, 0);
+
+	if (NULL == (pages = calloc(c.pages, sizeof(char *))))
+		err(EXIT_FAILURE, NULL);
+	for (i = 0; i < c.pages; i++) {
+		if (-1 == asprintf(&pages[i], "%s/%05zu.html", dir, i))
+			err(EXIT_FAILURE, NULL);
+		page(&c, pages[i], i);
+	}
+
+	if (-1 == asprintf(&fill, "%s/filler.html", dir) ||
+	    -1 == asprintf(&cat, "%s/catalog.xliff", dir) ||
+	    -1 == asprintf(&ccat, "%s/catalog.sintlc", dir))
+		err(EXIT_FAILURE, NULL);
+	filler(&c, fill);
+
+	/* Room for: sintl -q -P jobs -X catalog pages... NULL */
+
+	if (NULL == (av = calloc(c.pages + 8, sizeof(char *))))
+		err(EXIT_FAILURE, NULL);
+	av[0] = sintl;
+
+	/* Catalog with translations copied from sources. */
+
+	av[1] = "-c";
+	av[2] = "-e";
+	for (i = 0; i < c.pages; i++)
+		av[3 + i] = pages[i];
+	av[3 + i] = fill;
+	av[4 + i] = NULL;
+	run(av, cat, &secs, &rss);
+
+	av[1] = "-C";
+	av[2] = cat;
+	av[3] = ccat;
+	av[4] = NULL;
+	run(av, NULL, &secs, &rss);
+
+	printf("corpus: %zu pages, %.2f MB, %zu segments, "
+		"%zu%% repeated, %zu%% phrasing, depth %zu\n",
+		c.pages, c.bytes / (1024.0 * 1024.0), c.segs,
+		c.repeat, c.phrasing, c.depth);
+	printf("catalog: %zu filler units\n", c.filler);
+	printf("%-6s %10s %10s %12s %12s\n",
+		"mode", "best (s)", "MB/s", "segments/s", "peak RSS KB");
+
+	/* Arguments common to all modes, then the mode. */
+
+	av[1] = "-q";
+	n = 2;
+	if (NULL != jobs) {
+		av[n++] = "-P";
+		av[n++] = jobs;
+	}
+	for (i = 0; i < c.pages; i++)
+		av[n + 2 + i] = pages[i];
+	av[n + 2 + i] = NULL;
+
+	av[n] = "-e";
+	av[n + 1] = "-c";
+	bench(&c, "-e", av, iters);
+
+	av[n] = "-j";
+	av[n + 1] = cat;
+	bench(&c, "-j", av, iters);
+
+	av[n] = "-J";
+	av[n + 1] = ccat;
+	bench(&c, "-J", av, iters);
+
+	av[n] = "-u";
+	av[n + 1] = cat;
+	bench(&c, "-u", av, iters);
+
+	if (keep)
+		printf("corpus kept in %s\n", dir);
+	else {
+		for (i = 0; i < c.pages; i++)
+			unlink(pages[i]);
+		unlink(fill);
+		unlink(cat);
+		unlink(ccat);
+		if (-1 == rmdir(dir))
+			warn("%s", dir);
+	}
+
+	for (i = 0; i < c.pages; i++)
+		free(pages[i]);
+	for (i = 0; i < POOLSZ; i++)
+		free(pool[i]);
+	free(pages);
+	free((void *)av);
+	free(fill);
+	free(cat);
+	free(ccat);
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "usage: %s [-k] [-c filler] [-d depth] "
+		"[-i iterations] [-n pages] [-P jobs] [-p phrasing] "
+		"[-r repeat] [-S seed] [-s pagesize] [-x sintl]\n",
+		getprogname());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,207 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <expat.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_SHA2_H
+# include <sha2.h>
+#endif
+#include <unistd.h>
+
+#include "extern.h"
+
+/*
+ * The extraction cache holds the words extracted from each input file,
+ * named by the SHA-256 digest of the file's contents.
+ * Each cache file begins with CACHE_MAGIC, then "nohtml" if the input
+ * had no <html> element, "nolang" if it had one without a language, or
+ * "lang" and the length of the language followed by the language.
+ * Then come the file's distinct words, each "line col count len"
+ * followed by the source.
+ * Strings are followed by a newline.
+ * The magic must be changed whenever extraction changes.
+ */
+#define	CACHE_MAGIC	"sintl-words 2\n"
+
+/*
+ * Name of the cache file in "dir" for an input with the given contents.
+ * The name must be freed.
+ */
+char *
+cache_path(const char *dir, const char *map, size_t mapsz)
+{
+	char	 digest[SHA256_DIGEST_STRING_LENGTH];
+	char	*path;
+
+	SHA256Data((const uint8_t *)map, mapsz, digest);
+	if (-1 == asprintf(&path, "%s/%s", dir, digest))
+		err(EXIT_FAILURE, NULL);
+	return path;
+}
+
+/*
+ * Read a string of "len" bytes and its trailing newline from "f", which
+ * is "fsz" bytes long.
+ * Returns the new string or NULL if malformed.
+ */
+static char *
+cache_str(FILE *f, size_t fsz, size_t len)
+{
+	char	*s;
+
+	if (len >= fsz)
+		return NULL;
+	if (NULL == (s = malloc(len + 1)))
+		err(EXIT_FAILURE, NULL);
+	if (len != fread(s, 1, len, f) || '\n' != getc(f) ||
+	    NULL != memchr(s, '\0', len)) {
+		free(s);
+		return NULL;
+	}
+	s[len] = '\0';
+	return s;
+}
+
+/*
+ * Add the words cached in "path" to those of "hp" and set the language
+ * as if the input had been parsed.
+ * Returns zero if there's no such cache file or it's malformed, in
+ * which case "hp" is unchanged.
+ */
+int
+cache_read(struct hparse *hp, const char *path)
+{
+	FILE		*f;
+	struct stat	 st;
+	struct wordset	 words;
+	char		*line = NULL, *lang = NULL, *source;
+	size_t		 linesz = 0, ln, col, count, len;
+	int		 html = 1, rc = 0;
+
+	memset(&words, 0, sizeof(struct wordset));
+
+	if (NULL == (f = fopen(path, "r"))) {
+		if (ENOENT != errno)
+			warn("%s", path);
+		return 0;
+	}
+
+	if (-1 == fstat(fileno(f), &st) ||
+	    -1 == getline(&line, &linesz, f) ||
+	    strcmp(line, CACHE_MAGIC) ||
+	    -1 == getline(&line, &linesz, f))
+		goto out;
+
+	if (0 == strcmp(line, "nohtml\n"))
+		html = 0;
+	else if (1 == sscanf(line, "lang %zu\n", &len)) {
+		if (NULL == (lang = cache_str(f, st.st_size, len)))
+			goto out;
+	} else if (strcmp(line, "nolang\n"))
+		goto out;
+
+	while (-1 != getline(&line, &linesz, f)) {
+		if (4 != sscanf(line, "%zu %zu %zu %zu\n",
+		    &ln, &col, &count, &len) ||
+		    NULL == (source = cache_str(f, st.st_size, len)))
+			goto out;
+		wordset_add(&words, source, len, ln, col, count);
+		free(source);
+	}
+
+	if ( ! ferror(f))
+		rc = 1;
+out:
+	if (rc && html) {
+		free(hp->lang);
+		hp->lang = lang;
+		hp->html = 1;
+		lang = NULL;
+	}
+
+	if (rc)
+		wordset_merge(&hp->words, &words);
+	else
+		wordset_free(&words);
+
+	free(lang);
+	free(line);
+	fclose(f);
+	return rc;
+}
+
+/*
+ * Cache the words of "hp", and its language, into "path".
+ * The file is replaced atomically, so concurrent runs may share the
+ * cache.
+ * Failure is reported, but not otherwise an error.
+ */
+void
+cache_write(const struct hparse *hp, const char *path)
+{
+	FILE		*f;
+	char		*tmp;
+	int		 fd, er;
+	size_t		 i;
+	const struct word *w;
+
+	if (-1 == (fd = tmp_open(path, &tmp)))
+		return;
+
+	if (NULL == (f = fdopen(fd, "w"))) {
+		warn("%s", tmp);
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return;
+	}
+
+	fputs(CACHE_MAGIC, f);
+	if ( ! hp->html)
+		fputs("nohtml\n", f);
+	else if (NULL == hp->lang)
+		fputs("nolang\n", f);
+	else
+		fprintf(f, "lang %zu\n%s\n", strlen(hp->lang), hp->lang);
+
+	for (i = 0; i < hp->words.sz; i++) {
+		w = &hp->words.w[i];
+		fprintf(f, "%zu %zu %zu %zu\n%s\n", w->line, w->col,
+			w->count, strlen(w->source), w->source);
+	}
+
+	er = ferror(f);
+	if (EOF == fclose(f) || er) {
+		warn("%s", tmp);
+		unlink(tmp);
+	} else if (-1 == rename(tmp, path)) {
+		warn("%s", path);
+		unlink(tmp);
+	}
+
+	free(tmp);
+}
@@ -0,0 +1,692 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <assert.h>
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <errno.h>
+#include <expat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+/*
+ * A compiled catalog is laid out as follows, all in the byte order of
+ * the machine that wrote it:
+ *
+ *   struct cathdr
+ *   struct catunit[unitsz]
+ *   uint32_t[1 << hashbits] (index into units, from 1, or 0)
+ *   struct fnode[nodesz]
+ *   struct fattr[attsz]
+ *   char[strsz] (NUL-terminated strings)
+ *
+ * The hash index is the same open-addressed index as built by
+ * xliff_index(), so it may be used as-is.
+ * Bump CATALOG_VERSION when any of this changes.
+ */
+#define	CATALOG_MAGIC	"sintlcat"
+#define	CATALOG_VERSION	1
+#define	CATALOG_ORDER	0x01020304
+#define	CATALOG_NONE	UINT32_MAX
+
+struct	cathdr {
+	char		 magic[8]; /* CATALOG_MAGIC */
+	uint32_t	 version; /* CATALOG_VERSION */
+	uint32_t	 order; /* CATALOG_ORDER */
+	uint32_t	 hashbits; /* log2 of hash slots */
+	uint32_t	 unitsz; /* number of units */
+	uint32_t	 nodesz; /* number of target nodes */
+	uint32_t	 attsz; /* number of target attributes */
+	uint32_t	 strsz; /* size of string table */
+	uint32_t	 srclang; /* source language or CATALOG_NONE */
+	uint32_t	 trglang; /* target language or CATALOG_NONE */
+	uint32_t	 pad; /* zero */
+};
+
+struct	catunit {
+	uint64_t	 hash; /* hash of source */
+	uint32_t	 source; /* source string */
+	uint32_t	 sourcesz; /* length of source */
+	uint32_t	 node; /* first target node */
+	uint32_t	 nodesz; /* number of target nodes */
+};
+
+/*
+ * A compiled catalog that's been mapped into memory.
+ * Everything points into the map.
+ */
+struct	catmap {
+	const char	     *fname; /* mapped file name */
+	int		      fd; /* mapped file (or -1 if read) */
+	char		     *map; /* file contents */
+	size_t		      mapsz; /* size of map */
+	const struct cathdr  *hdr; /* header */
+	const struct catunit *units; /* units */
+	const uint32_t	     *hash; /* hash index */
+	const struct fnode   *nodes; /* target nodes */
+	const struct fattr   *atts; /* target attributes */
+	const char	     *strs; /* string table */
+};
+
+/*
+ * Multiplier for the key hash.
+ * This is the 64-bit FNV prime, used here in a simple polynomial.
+ * Being odd, it has a multiplicative inverse (modulo 2^64).
+ */
+#define	KEY_HASH_MULT	0x100000001b3ULL
+#define	KEY_HASH_INV	0xce965057aff6957bULL
+
+/*
+ * Continue hashing "len" bytes of "s" from the hash value "h".
+ * Start with a zero hash value.
+ */
+uint64_t
+key_hash(uint64_t h, const char *s, size_t len)
+{
+	size_t	 i;
+
+	for (i = 0; i < len; i++)
+		h = h * KEY_HASH_MULT + (unsigned char)s[i];
+
+	return h;
+}
+
+/*
+ * Undo key_hash(): given the hash "h" of a string ending in the "len"
+ * bytes of "s", return the hash of the string without them.
+ */
+uint64_t
+key_unhash(uint64_t h, const char *s, size_t len)
+{
+
+	while (len > 0)
+		h = (h - (unsigned char)s[--len]) * KEY_HASH_INV;
+
+	return h;
+}
+
+/*
+ * Given the hashes of two prefixes of a string, "h1" of length "len1"
+ * and "h2" of the longer "len2", return the hash of the bytes between
+ * them.
+ * This is h2 - h1 * KEY_HASH_MULT^(len2 - len1).
+ */
+uint64_t
+key_hash_span(uint64_t h1, size_t len1, uint64_t h2, size_t len2)
+{
+	uint64_t	 m = KEY_HASH_MULT;
+	size_t		 n;
+
+	assert(len2 >= len1);
+
+	for (n = len2 - len1; n > 0; n >>= 1) {
+		if (n & 1)
+			h1 *= m;
+		m *= m;
+	}
+
+	return h2 - h1;
+}
+
+/*
+ * Map a key hash into a slot of an index with 2^bits slots.
+ * The multiplier mixes the low-order bits up into the high-order bits,
+ * which are the ones we keep.
+ */
+size_t
+key_slot(uint64_t h, size_t bits)
+{
+
+	h ^= h >> 29;
+	return (size_t)((h * 0x9e3779b97f4a7c15ULL) >> (64 - bits));
+}
+
+/*
+ * Probe the index "slot" of 2^"bits" slots for the hash "h", calling
+ * "eq" with each entry found until it's non-zero.
+ * If "eq" is negative, the index is corrupt and probing stops.
+ * Returns the matching slot or the empty slot ending the probe, or
+ * SIZE_MAX if corrupt or every slot is full.
+ * If "probes" is not NULL, fill it with the number of slots visited.
+ */
+size_t
+slots_find(const uint32_t *slot, size_t bits, uint64_t h,
+	int (*eq)(const void *, size_t), const void *arg, size_t *probes)
+{
+	size_t	 j, n, mask;
+	int	 c;
+
+	mask = ((size_t)1 << bits) - 1;
+	j = key_slot(h, bits);
+
+	for (n = 1; ; n++, j = (j + 1) & mask) {
+		if (n > mask + 1) {
+			j = SIZE_MAX;
+			break;
+		}
+		if (0 == slot[j] || (c = eq(arg, slot[j] - 1)) > 0)
+			break;
+		if (c < 0) {
+			j = SIZE_MAX;
+			break;
+		}
+	}
+
+	if (NULL != probes)
+		*probes = n;
+	return j;
+}
+
+/*
+ * Make room in "s" for "n" entries, keeping the load factor at or
+ * below one half, with at least 2^"minbits" slots.
+ * If the index grows, existing entries are indexed again by "hash".
+ */
+void
+slots_reserve(struct slots *s, size_t n, size_t minbits,
+	uint64_t (*hash)(const void *, size_t), const void *arg)
+{
+	uint32_t	*old = s->slot;
+	size_t		 i, j, bits, mask, oldsz;
+
+	if (NULL != old && n * 2 <= ((size_t)1 << s->bits))
+		return;
+	if (n >= UINT32_MAX / 2)
+		errx(EXIT_FAILURE, "index too large");
+
+	bits = NULL == old ? minbits : s->bits + 1;
+	while (((size_t)1 << bits) < n * 2)
+		bits++;
+
+	mask = ((size_t)1 << bits) - 1;
+	if (NULL == (s->slot = calloc(mask + 1, sizeof(uint32_t))))
+		err(EXIT_FAILURE, NULL);
+
+	oldsz = NULL == old ? 0 : (size_t)1 << s->bits;
+	for (i = 0; i < oldsz; i++) {
+		if (0 == old[i])
+			continue;
+		j = key_slot(hash(arg, old[i] - 1), bits);
+		while (0 != s->slot[j])
+			j = (j + 1) & mask;
+		s->slot[j] = old[i];
+	}
+
+	free(old);
+	s->bits = bits;
+}
+
+void
+slots_free(struct slots *s)
+{
+
+	free(s->slot);
+	s->slot = NULL;
+	s->bits = 0;
+}
+
+/*
+ * A key being looked up in the units of a dictionary or catalog.
+ */
+struct	unitkey {
+	const struct xparse  *xp; /* if not NULL, the dictionary */
+	const struct catmap  *cat; /* if not NULL, the catalog */
+	const struct fragkey *k; /* if looking up, the key */
+	const struct xliff   *x; /* if indexing, the unit */
+};
+
+/*
+ * Whether the unit "i" of a dictionary has the key or source sought.
+ */
+static int
+xliff_eq(const void *arg, size_t i)
+{
+	const struct unitkey *uk = arg;
+	const struct xliff   *x = &uk->xp->xliffs[i];
+
+	if (NULL != uk->x)
+		return x->hash == uk->x->hash &&
+			0 == strcmp(x->source, uk->x->source);
+
+	return x->hash == uk->k->hash &&
+		frag_key_eq(uk->k, x->source, strlen(x->source));
+}
+
+/*
+ * Build the open-addressed hash index over all translation units in
+ * "xp", keyed by the serialised source.
+ * If a source appears more than once, only the first is indexed: this
+ * mirrors a linear scan of the translation units.
+ */
+void
+xliff_index(struct xparse *xp)
+{
+	struct unitkey	 uk;
+	size_t		 i, j;
+
+	slots_free(&xp->idx);
+
+	if (xp->xliffsz >= UINT32_MAX / 2)
+		errx(EXIT_FAILURE, "%s: too many units", xp->fname);
+
+	slots_reserve(&xp->idx, xp->xliffsz, 4, NULL, NULL);
+
+	memset(&uk, 0, sizeof(struct unitkey));
+	uk.xp = xp;
+
+	for (i = 0; i < xp->xliffsz; i++) {
+		uk.x = &xp->xliffs[i];
+		xp->xliffs[i].hash = key_hash(0, uk.x->source,
+			strlen(uk.x->source));
+		j = slots_find(xp->idx.slot, xp->idx.bits,
+			uk.x->hash, xliff_eq, &uk, NULL);
+		assert(SIZE_MAX != j);
+		if (0 == xp->idx.slot[j])
+			xp->idx.slot[j] = i + 1;
+	}
+}
+
+/*
+ * Look up the translation unit whose source is the key "k".
+ * If "probes" is not NULL, fill it with the number of slots visited.
+ * Returns zero if not found, else fills in "t" with the target.
+ */
+int
+xliff_lookup(const struct xparse *xp, 
+	const struct fragkey *k, size_t *probes, struct ftarget *t)
+{
+	struct unitkey	 uk;
+	size_t		 j;
+
+	if (NULL != xp->cat)
+		return catalog_lookup(xp->cat, k, probes, t);
+
+	if (NULL == xp->idx.slot) {
+		if (NULL != probes)
+			*probes = 0;
+		return 0;
+	}
+
+	memset(&uk, 0, sizeof(struct unitkey));
+	uk.xp = xp;
+	uk.k = k;
+
+	j = slots_find(xp->idx.slot, xp->idx.bits,
+		k->hash, xliff_eq, &uk, probes);
+	assert(SIZE_MAX != j);
+
+	return 0 == xp->idx.slot[j] ? 0 :
+		xliff_target(xp, xp->idx.slot[j] - 1, t);
+}
+
+/*
+ * Check that the target of "u" fits within the catalog.
+ * We do this lazily so that opening a catalog doesn't need to touch
+ * more than the header.
+ */
+static int
+catalog_check(const struct catmap *cat, const struct catunit *u)
+{
+	const struct fnode *n;
+	size_t		    i, j;
+
+	if (u->source >= cat->hdr->strsz ||
+	    u->sourcesz >= cat->hdr->strsz - u->source ||
+	    0 == u->nodesz ||
+	    u->node > cat->hdr->nodesz ||
+	    u->nodesz > cat->hdr->nodesz - u->node)
+		return 0;
+
+	for (i = 0; i < u->nodesz; i++) {
+		n = &cat->nodes[u->node + i];
+		if (n->end <= i || n->end > u->nodesz ||
+		    n->val >= cat->hdr->strsz ||
+		    n->valsz >= cat->hdr->strsz - n->val ||
+		    n->atts > cat->hdr->attsz ||
+		    n->attsz > cat->hdr->attsz - n->atts)
+			return 0;
+		for (j = 0; j < n->attsz; j++)
+			if (cat->atts[n->atts + j].key >= 
+			     cat->hdr->strsz ||
+			    cat->atts[n->atts + j].val >= 
+			     cat->hdr->strsz)
+				return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Whether the unit "i" of a catalog has the key sought.
+ * Units are checked lazily, as they're found.
+ */
+static int
+catalog_eq(const void *arg, size_t i)
+{
+	const struct unitkey  *uk = arg;
+	const struct catunit  *u;
+
+	if (i >= uk->cat->hdr->unitsz)
+		return -1;
+	u = &uk->cat->units[i];
+	if (u->hash != uk->k->hash)
+		return 0;
+	if ( ! catalog_check(uk->cat, u))
+		return -1;
+	return frag_key_eq(uk->k,
+		uk->cat->strs + u->source, u->sourcesz);
+}
+
+/*
+ * Like xliff_lookup(), but in a compiled catalog.
+ */
+int
+catalog_lookup(const struct catmap *cat,
+	const struct fragkey *k, size_t *probes, struct ftarget *t)
+{
+	struct unitkey		 uk;
+	const struct catunit	*u;
+	size_t			 j;
+
+	memset(&uk, 0, sizeof(struct unitkey));
+	uk.cat = cat;
+	uk.k = k;
+
+	/* A corrupt index may have no empty slots. */
+
+	j = slots_find(cat->hash, cat->hdr->hashbits,
+		k->hash, catalog_eq, &uk, probes);
+
+	if (SIZE_MAX == j) {
+		fprintf(stderr, "%s: corrupt catalog\n", cat->fname);
+		return 0;
+	} else if (0 == cat->hash[j])
+		return 0;
+
+	u = &cat->units[cat->hash[j] - 1];
+	t->nodes = cat->nodes + u->node;
+	t->nodesz = u->nodesz;
+	t->atts = cat->atts;
+	t->strs = cat->strs;
+	return 1;
+}
+
+static int
+writeall(int fd, const void *buf, size_t sz)
+{
+	const char	*cp = buf;
+	ssize_t		 ssz;
+
+	while (sz > 0) {
+		if ((ssz = write(fd, cp, sz)) < 0) {
+			if (EINTR == errno)
+				continue;
+			return 0;
+		}
+		cp += ssz;
+		sz -= (size_t)ssz;
+	}
+
+	return 1;
+}
+
+/*
+ * Write the parsed and indexed XLIFF "xp" as a compiled catalog into
+ * "fname".
+ * The catalog is written into a temporary file and renamed into place,
+ * so readers never see a partial catalog.
+ * This appends to the string table of "xp".
+ * Returns zero on failure.
+ */
+int
+catalog_write(struct xparse *xp, const char *fname)
+{
+	struct cathdr	 hdr;
+	struct catunit	*units;
+	size_t		 i;
+	char		*tmp;
+	int		 fd, rc;
+
+	assert(NULL == xp->cat);
+	assert(NULL != xp->idx.slot);
+
+	units = calloc(xp->xliffsz + 1, sizeof(struct catunit));
+	if (NULL == units)
+		err(EXIT_FAILURE, NULL);
+
+	memset(&hdr, 0, sizeof(struct cathdr));
+	memcpy(hdr.magic, CATALOG_MAGIC, sizeof(hdr.magic));
+	hdr.version = CATALOG_VERSION;
+	hdr.order = CATALOG_ORDER;
+	hdr.hashbits = xp->idx.bits;
+	hdr.unitsz = xp->xliffsz;
+	hdr.srclang = NULL == xp->srclang ? CATALOG_NONE :
+		ftable_str(&xp->tab, xp->srclang, strlen(xp->srclang));
+	hdr.trglang = NULL == xp->trglang ? CATALOG_NONE :
+		ftable_str(&xp->tab, xp->trglang, strlen(xp->trglang));
+
+	for (i = 0; i < xp->xliffsz; i++) {
+		units[i].hash = xp->xliffs[i].hash;
+		units[i].sourcesz = strlen(xp->xliffs[i].source);
+		units[i].source = ftable_str(&xp->tab, 
+			xp->xliffs[i].source, units[i].sourcesz);
+		units[i].node = xp->xliffs[i].node;
+		units[i].nodesz = xp->xliffs[i].nodesz;
+	}
+
+	/* The string table is complete, so fill in our sizes. */
+
+	hdr.nodesz = xp->tab.nodesz;
+	hdr.attsz = xp->tab.attsz;
+	hdr.strsz = xp->tab.strsz;
+
+	if (-1 == (fd = tmp_open(fname, &tmp))) {
+		free(units);
+		return 0;
+	}
+
+	rc = writeall(fd, &hdr, sizeof(struct cathdr)) &&
+	     writeall(fd, units, 
+		xp->xliffsz * sizeof(struct catunit)) &&
+	     writeall(fd, xp->idx.slot, 
+		((size_t)1 << xp->idx.bits) * sizeof(uint32_t)) &&
+	     writeall(fd, xp->tab.nodes, 
+		xp->tab.nodesz * sizeof(struct fnode)) &&
+	     writeall(fd, xp->tab.atts, 
+		xp->tab.attsz * sizeof(struct fattr)) &&
+	     writeall(fd, xp->tab.strs, xp->tab.strsz);
+
+	if ( ! rc)
+		perror(tmp);
+
+	if (-1 == close(fd) && rc) {
+		perror(tmp);
+		rc = 0;
+	}
+
+	if (rc && -1 == rename(tmp, fname)) {
+		perror(fname);
+		rc = 0;
+	}
+
+	if ( ! rc)
+		unlink(tmp);
+
+	free(tmp);
+	free(units);
+	return rc;
+}
+
+/*
+ * Map the compiled catalog "fname" into "xp".
+ * If "keep" is set, it's read into memory instead, as the file may be
+ * changed or truncated while the catalog is still in use.
+ * Only the header is checked here: units are checked as they're used.
+ * Returns zero on failure.
+ */
+int
+catalog_open(struct xparse *xp, const char *fname, int keep)
+{
+	struct catmap	*cat;
+	const char	*er = NULL;
+	uint64_t	 sz;
+
+	if (NULL == (cat = calloc(1, sizeof(struct catmap))))
+		err(EXIT_FAILURE, NULL);
+
+	cat->fname = fname;
+
+	if (keep) {
+		cat->fd = -1;
+		cat->map = file_read(fname, &cat->mapsz);
+		if (NULL == cat->map) {
+			free(cat);
+			return 0;
+		}
+	} else if (-1 == (cat->fd = 
+	    map_open(fname, &cat->mapsz, &cat->map))) {
+		free(cat);
+		return 0;
+	}
+
+	cat->hdr = (const struct cathdr *)cat->map;
+
+	if (cat->mapsz < sizeof(struct cathdr) ||
+	    memcmp(cat->hdr->magic, CATALOG_MAGIC, 8))
+		er = "not a compiled catalog";
+	else if (CATALOG_VERSION != cat->hdr->version)
+		er = "unknown catalog version";
+	else if (CATALOG_ORDER != cat->hdr->order)
+		er = "catalog has different byte order";
+	else if (cat->hdr->hashbits < 4 || cat->hdr->hashbits > 31)
+		er = "corrupt catalog";
+
+	if (NULL != er) {
+		fprintf(stderr, "%s: %s\n", fname, er);
+		catalog_close(cat);
+		return 0;
+	}
+
+	sz = sizeof(struct cathdr) +
+		(uint64_t)cat->hdr->unitsz * sizeof(struct catunit) +
+		((uint64_t)1 << cat->hdr->hashbits) * sizeof(uint32_t) +
+		(uint64_t)cat->hdr->nodesz * sizeof(struct fnode) +
+		(uint64_t)cat->hdr->attsz * sizeof(struct fattr) +
+		(uint64_t)cat->hdr->strsz;
+
+	cat->units = (const struct catunit *)(cat->hdr + 1);
+	cat->hash = (const uint32_t *)(cat->units + cat->hdr->unitsz);
+	cat->nodes = (const struct fnode *)
+		(cat->hash + ((size_t)1 << cat->hdr->hashbits));
+	cat->atts = (const struct fattr *)
+		(cat->nodes + cat->hdr->nodesz);
+	cat->strs = (const char *)(cat->atts + cat->hdr->attsz);
+
+	if (sz != cat->mapsz ||
+	    (cat->hdr->strsz && '\0' != cat->strs[cat->hdr->strsz - 1]) ||
+	    (CATALOG_NONE != cat->hdr->srclang &&
+	     cat->hdr->srclang >= cat->hdr->strsz) ||
+	    (CATALOG_NONE != cat->hdr->trglang &&
+	     cat->hdr->trglang >= cat->hdr->strsz)) {
+		fprintf(stderr, "%s: corrupt catalog\n", fname);
+		catalog_close(cat);
+		return 0;
+	}
+
+	if (CATALOG_NONE != cat->hdr->srclang &&
+	    NULL == (xp->srclang = 
+	     strdup(cat->strs + cat->hdr->srclang)))
+		err(EXIT_FAILURE, NULL);
+	if (CATALOG_NONE != cat->hdr->trglang &&
+	    NULL == (xp->trglang = 
+	     strdup(cat->strs + cat->hdr->trglang)))
+		err(EXIT_FAILURE, NULL);
+
+	xp->cat = cat;
+	return 1;
+}
+
+void
+catalog_close(struct catmap *cat)
+{
+
+	if (-1 == cat->fd)
+		free(cat->map);
+	else
+		map_close(cat->fd, cat->map, cat->mapsz);
+	free(cat);
+}
+
+/*
+ * Report the shape of the index and the lookups made against it.
+ * This is used in verbose mode to check the quality of the hash.
+ */
+void
+xliff_stats(const struct hout *ho)
+{
+	const struct xparse *xp = ho->xp;
+	size_t		 i, j, n, used = 0, max = 0, total = 0, 
+			 mask, bits, unitsz;
+	const uint32_t	*hash;
+	uint64_t	 h;
+
+	if (NULL != xp->cat) {
+		hash = xp->cat->hash;
+		bits = xp->cat->hdr->hashbits;
+		unitsz = xp->cat->hdr->unitsz;
+	} else {
+		hash = xp->idx.slot;
+		bits = xp->idx.bits;
+		unitsz = xp->xliffsz;
+	}
+
+	mask = ((size_t)1 << bits) - 1;
+
+	/* Compute the probe length for each indexed unit. */
+
+	for (i = 0; NULL != hash && i <= mask; i++) {
+		if (0 == hash[i] || hash[i] > unitsz)
+			continue;
+		used++;
+		h = NULL != xp->cat ? 
+			xp->cat->units[hash[i] - 1].hash :
+			xp->xliffs[hash[i] - 1].hash;
+		j = key_slot(h, bits);
+		n = ((i - j) & mask) + 1;
+		total += n;
+		if (n > max)
+			max = n;
+	}
+
+	fprintf(stderr, "%s: %zu units, %zu indexed, %zu slots, "
+		"%.2f mean probes, %zu max probes\n", xp->fname,
+		unitsz, used, NULL == hash ? 0 : mask + 1,
+		used ? (double)total / used : 0.0, max);
+	fprintf(stderr, "%s: %zu lookups, %.2f mean probes, "
+		"%zu max probes\n", xp->fname, ho->lookups,
+		ho->lookups ? (double)ho->probes / ho->lookups : 0.0,
+		ho->probemax);
+	fprintf(stderr, "%s: %zu repeated segments\n",
+		xp->fname, ho->repeats);
+}
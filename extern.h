@@ -17,6 +17,56 @@
 #ifndef EXTERN_H
 #define EXTERN_H
 
+/*
+ * Command-line options.
+ */
+struct	opts {
+	int		 copy; /* copy missing translations (-c) */
+	int		 keep; /* keep unused translations (-k) */
+	int		 quiet; /* don't note changes (-q) */
+	int		 verbose; /* report on lookups (-v) */
+	size_t		 jobs; /* parallel jobs (-P) */
+	const char	*outdir; /* output directory (-o) */
+	const char	*outtmpl; /* output file template (-t) */
+	const char	*cache; /* extraction cache directory (-x) */
+	size_t		 budget; /* bytes for scanned words (-m) or 0 */
+	const char	**dirs; /* directories to walk (-R) */
+	size_t		 dirsz; /* number of dirs */
+	const char	**incs; /* globs of files to walk (-I) */
+	size_t		 incsz; /* number of incs */
+	const char	**excs; /* globs not to walk (-X) */
+	size_t		 excsz; /* number of excs */
+};
+
+/*
+ * A growable byte buffer.
+ * Once anything has been appended, the data is NUL-terminated.
+ */
+struct	buf {
+	char		*b; /* data (or NULL) */
+	size_t		 sz; /* length of data */
+	size_t		 max; /* allocated size */
+};
+
+/*
+ * An output sink.
+ * Output is buffered and written to the file descriptor as the buffer
+ * fills; or if the descriptor is -1, accumulated in memory.
+ */
+struct	sink {
+	int		 fd; /* output (or -1 for memory) */
+	struct buf	 buf; /* pending (or all) output */
+	int		 er; /* errno of failed write or 0 */
+};
+
+/*
+ * A catalog given on the command line.
+ */
+struct	catname {
+	const char	*fname; /* file name */
+	int		 compiled; /* compiled catalog (-J) */
+};
+
 enum	pop {
 	POP_JOIN,
 	POP_EXTRACT
@@ -28,7 +78,7 @@ enum	pop {
  * similarly-named elements.
  */
 struct	stack {
-	char	 	*name; /* element name of context */
+	const char	*name; /* element name of context (interned) */
 	size_t	 	 nested; /* nested same-name elements */
 	int		 translate; /* translate or not */
 	int		 preserve; /* preserve whitespace */
@@ -47,6 +97,7 @@ enum	fragtype {
  */
 struct	frag {
 	char		 *val; /* element name or text data */
+	const char	 *name; /* if node, frag_intern() of name */
 	size_t		  valsz; /* string length of valsz */
 	int		  node_closed; /* if node, whether closed */
 	int		  has_nonws; /* if text, whether has non-ws */
@@ -55,21 +106,140 @@ struct	frag {
 	enum fragtype	  type; /* type of node */
 	struct frag	**child; /* array of child nodes */
 	size_t		  childsz; /* number of child nodes */
+	size_t		  childmax; /* child buffer size */
 	struct frag	 *next; /* next node */
 	struct frag	 *parent; /* parent (NULL if root) */
 	size_t		  id; /* index in fragseq->elemsz */
+	size_t		  nodesz; /* element children */
+	size_t		  wssz; /* white-space only text children */
+	uint64_t	  hbeg; /* if keyed, key hash before node */
+	uint64_t	  hend; /* if keyed, key hash after node */
+	size_t		  kbeg; /* if keyed, key length before node */
+	size_t		  kend; /* if keyed, key length after node */
+};
+
+/*
+ * An open-addressed hash index into some array: each slot is an array
+ * index (from 1) or 0 if empty.
+ * See slots_find() and slots_reserve().
+ */
+struct	slots {
+	uint32_t	*slot; /* 2^bits slots (or NULL) */
+	size_t		 bits; /* log2 of slots */
+};
+
+struct	arenablk;
+
+/*
+ * A bump allocator.
+ * Allocations are never freed individually: the arena is reset as a
+ * whole, keeping its blocks for reuse.
+ */
+struct	arena {
+	struct arenablk	*first; /* first block (or NULL) */
+	struct arenablk	*cur; /* block being allocated from */
+};
+
+/*
+ * Interned element and attribute names.
+ * Equal names are stored once, so may be compared by pointer.
+ */
+struct	names {
+	char		**tab; /* names */
+	size_t		  count; /* number of names */
+	size_t		  max; /* tab buffer size */
+	struct slots	  idx; /* index into tab */
+	struct arena	  arena; /* name storage */
 };
 
 /*
  * Sequence of fragments.
+ * All nodes, attribute values, and text are allocated from the arena,
+ * which is reset when the sequence is cleared.
+ * Element and attribute names are interned and kept across clears.
  */
 struct	fragseq {
 	struct frag	 *root; /* root of fragment tree */
 	struct frag	 *cur; /* current node in fragment parse */
-	char		 *copy; /* verbatim copy of all text */
-	size_t		  copysz; /* length of copy */
+	struct buf	  copy; /* verbatim copy of all text */
 	struct frag	**elems;
 	size_t		  elemsz;
+	size_t		  elemmax; /* elems buffer size */
+	struct arena	  arena; /* fragment storage */
+	struct names	  names; /* interned names */
+	int		  keyed; /* whether to hash keys while building */
+	uint64_t	  khash; /* if keyed, hash of serialised tree */
+	size_t		  ksz; /* if keyed, length of serialised tree */
+};
+
+/*
+ * The translation key of a fragment sequence: the serialised children
+ * [first, last) of "node", less "lead" and "trail" bytes of surrounding
+ * white-space.
+ * If the sequence was keyed, the key's hash is computed from the hashes
+ * of the children without serialising it; otherwise, "key" holds it.
+ */
+struct	fragkey {
+	const struct frag *node; /* parent of key content */
+	size_t		   first; /* first child in key */
+	size_t		   last; /* past last child in key */
+	size_t		   lead; /* leading white-space to trim */
+	size_t		   trail; /* trailing white-space to trim */
+	size_t		   len; /* length of key */
+	uint64_t	   hash; /* key_hash() of key */
+	const char	  *key; /* serialised key (or NULL) */
+};
+
+/*
+ * A node of a flattened translation target.
+ * Targets are stored as pre-order runs of nodes, the first being the
+ * root: a node's children begin with the node following it, and its
+ * next sibling is at "end" (relative to the root).
+ * Strings are offsets into a table of NUL-terminated strings.
+ */
+struct	fnode {
+	uint32_t	 type; /* enum fragtype */
+	uint32_t	 is_null; /* if node, whether is null */
+	uint32_t	 val; /* element name or text data */
+	uint32_t	 valsz; /* string length of val */
+	uint32_t	 atts; /* if node, first attribute */
+	uint32_t	 attsz; /* if node, number of attributes */
+	uint32_t	 end; /* index past last descendent */
+};
+
+/*
+ * An attribute of a flattened node.
+ */
+struct	fattr {
+	uint32_t	 key; /* attribute name */
+	uint32_t	 val; /* attribute value */
+};
+
+/*
+ * Tables holding all flattened translation targets.
+ * These are either built when parsing an XLIFF file or are mapped
+ * from a compiled catalog.
+ */
+struct	ftable {
+	struct fnode	*nodes; /* all nodes */
+	size_t		 nodesz; /* number of nodes */
+	size_t		 nodemax; /* node buffer size */
+	struct fattr	*atts; /* all attributes */
+	size_t		 attsz; /* number of attributes */
+	size_t		 attmax; /* attribute buffer size */
+	char		*strs; /* all strings */
+	size_t		 strsz; /* length of strings */
+	size_t		 strmax; /* string buffer size */
+};
+
+/*
+ * A single translation target within a table.
+ */
+struct	ftarget {
+	const struct fnode *nodes; /* root and descendents */
+	size_t		    nodesz; /* number of nodes */
+	const struct fattr *atts; /* attribute table */
+	const char	   *strs; /* string table */
 };
 
 /*
@@ -79,7 +249,14 @@ struct	xliff {
 	size_t		 col; /* column (from 1) */
 	size_t		 line; /* line (from 1) */
 	char		*source; /* key */
-	struct fragseq	 target; /* target */
+	uint64_t	 hash; /* hash of key */
+	char		*copy; /* verbatim copy of target */
+	size_t		 copysz; /* length of copy (0 if none) */
+	size_t		 node; /* first target node in table */
+	size_t		 nodesz; /* target nodes (0 if none) */
+	size_t		 off; /* if lazy, target content in file */
+	size_t		 offsz; /* if lazy, length of content */
+	struct ftable	*tab; /* if lazy, parsed target (or NULL) */
 };
 
 /*
@@ -89,6 +266,70 @@ struct	word {
 	size_t		 col; /* column (from 1) */
 	size_t		 line; /* line (from 1) */
 	char		*source; /* key */
+	uint64_t	 hash; /* key_hash() of key */
+	size_t		 count; /* occurrences */
+};
+
+/*
+ * Distinct words scanned for translation, each at its first position.
+ * Words are indexed by key while scanning; once sorted, they're not.
+ */
+struct	wordset {
+	struct word	*w; /* words */
+	size_t		 sz; /* number of words */
+	size_t		 max; /* word buffer size */
+	struct slots	 idx; /* index into words */
+	size_t		 bytes; /* approximate memory used */
+};
+
+/*
+ * Sorted words spilled to a temporary file (see spill.c).
+ * Each holds a file open, so at most RUNS_MAX are kept at once.
+ */
+#define	RUNS_MAX 64
+
+struct	wordrun {
+	FILE		*f; /* run file */
+	struct word	 w; /* if merging, current word */
+	size_t		 max; /* its source buffer size */
+	size_t		 size; /* bytes written */
+};
+
+/*
+ * A segment already translated into an output (see memo.c).
+ */
+struct	memoent {
+	uint64_t	 hash; /* key_hash() of input */
+	int		 preserve; /* whether white-space was preserved */
+	size_t		 in; /* input in data */
+	size_t		 insz; /* length of input */
+	size_t		 out; /* output in data */
+	size_t		 outsz; /* length of output */
+};
+
+/*
+ * Translated segments by their input.
+ */
+struct	memo {
+	struct memoent	*ents; /* segments */
+	size_t		 entsz; /* number of segments */
+	size_t		 entmax; /* segment buffer size */
+	struct slots	 idx; /* index into ents */
+	struct buf	 data; /* inputs and outputs */
+};
+
+/*
+ * A translation being emitted while joining: there's one for each
+ * catalog, all fed from the same parse.
+ */
+struct	hout {
+	const struct xparse *xp; /* XLIFF for translation */
+	struct sink	 out; /* output */
+	struct memo	 memo; /* if passing through, translated segments */
+	size_t		 lookups; /* catalog lookups */
+	size_t		 probes; /* total slots probed in lookups */
+	size_t		 probemax; /* maximum slots probed */
+	size_t		 repeats; /* segments translated from memo */
 };
 
 /*
@@ -102,17 +343,34 @@ struct	hparse {
 	XML_Parser	 p;
 	const char	*fname; /* file being parsed */
 	enum pop	 op; /* what we're doing */
-	struct word	*words; /* if scanning, scanned words */
-	size_t		 wordsz; /* number of words */
-	size_t		 wordmax; /* word buffer size */
+	struct wordset	 words; /* if scanning, scanned words */
+	size_t		 budget; /* if scanning, bytes before spilling */
+	struct wordrun	*runs; /* if scanning, spilled words */
+	size_t		 runsz; /* number of runs */
+	size_t		 runmax; /* most runs kept open */
+	size_t		 spills; /* runs ever written */
+	size_t		 next; /* if emitting, next unspilled word */
+	struct word	 cur; /* if emitting runs, current word */
+	size_t		 curmax; /* its source buffer size */
 	struct fragseq	 frag; /* current source/target fragment */
 	struct stack	 stack[64]; /* stack of contexts */
 	size_t		 stacksz; /* stack size */
-	const struct xparse *xp; /* XLIFF for source (or NULL) */
+	const struct xparse *xp; /* if updating, XLIFF (or NULL) */
+	const struct opts *opts; /* command-line options */
+	struct hout	*outs; /* if translating, outputs */
+	size_t		 outsz; /* number of outputs */
 	char	 	*lang; /* <html> language definition */
-	int		 copy; /* copy missing translations */
+	int		 html; /* whether <html> seen in file */
+	struct buf	 key; /* scratch for serialised keys */
+	struct sink	 render; /* scratch for translated segments */
+	const char	*map; /* if joining, input passed through */
+	size_t		 pass; /* if so, input not yet written */
 };
 
+struct	catmap;
+struct	inputs;
+struct	xlazy;
+
 enum	xnesttype {
 	NEST_TARGET,
 	NEST_SOURCE
@@ -129,31 +387,120 @@ struct	xparse {
 	struct xliff	 *xliffs; /* current xliffs */
 	size_t		  xliffsz; /* current size of xliffs */
 	size_t		  xliffmax; /* xliff buffer size */
+	struct slots	  idx; /* index into xliffs */
+	struct ftable	  tab; /* flattened targets */
+	struct catmap	 *cat; /* compiled catalog (or NULL) */
+	struct xlazy	 *lazy; /* if targets parsed on use (or NULL) */
 	struct fragseq	  frag;
 	char		 *source; /* current source in segment */
-	struct fragseq	  target; /* current target in segment */
+	struct xliff	  target; /* current target in segment */
 	size_t		  nest; /* nesting in extraction */
 	enum xnesttype	  nesttype; /* type of nesting */
 	char	 	 *srclang; /* <xliff> srcLang definition */
 	char	 	 *trglang; /* <xliff> trgLang definition */
+	const char	 *base; /* if a lazy target, file contents */
+	size_t		  baseoff; /* if a lazy target, its offset */
 };
 
 __BEGIN_DECLS
 
-int	 extract(XML_Parser, int, int, char *[]);
-int	 join(const char *, XML_Parser, int, int, char *[]);
+int	 extract(XML_Parser, const struct opts *, int, char *[]);
+int	 compile(const char *, XML_Parser, const char *);
+int	 join(const struct catname *, size_t, XML_Parser, 
+		const struct opts *, int, char *[]);
 int	 update(const char *, XML_Parser, 
-		int, int, int, int, char *[]);
+		const struct opts *, int, char *[]);
+int	 serve(const struct catname *, size_t, XML_Parser,
+		const struct opts *, const char *);
+int	 join_doc(XML_Parser, const struct opts *, const struct xparse *,
+		const char *, const char *, size_t, struct sink *);
+struct xparse *catalog_load(const struct catname *, XML_Parser, int);
+void	 xparse_free(struct xparse *);
 
 void	 frag_node_start(struct fragseq *, 
 		const XML_Char *, const XML_Char **, int);
 void	 frag_node_text(struct fragseq *,
 	 	const XML_Char *, size_t, int);
-void	 frag_node_end(struct fragseq *, const XML_Char *);
-char	*frag_serialise(const struct fragseq *, int, int *);
-void	 frag_print_merge(const struct fragseq *, 
-		const char *, const struct fragseq *);
+void	 frag_node_end(struct fragseq *, const char *);
+const char *frag_serialise(const struct fragseq *, 
+		int, int, struct buf *);
+int	 frag_key(const struct fragseq *, struct fragkey *, struct buf *);
+int	 frag_key_eq(const struct fragkey *, const char *, size_t);
+void	 frag_print_merge(struct sink *, const struct fragseq *, 
+		const struct ftarget *);
+void	 frag_flatten(const struct fragseq *, 
+		struct ftable *, size_t *, size_t *);
+const char *frag_intern(struct fragseq *, const char *);
+void	 buf_append(struct buf *, const char *, size_t);
+void	 buf_free(struct buf *);
 void	 fragseq_clear(struct fragseq *);
+void	 fragseq_free(struct fragseq *);
+void	 ftable_clear(struct ftable *);
+uint32_t ftable_str(struct ftable *, const char *, size_t);
+
+uint64_t key_hash(uint64_t, const char *, size_t);
+uint64_t key_unhash(uint64_t, const char *, size_t);
+uint64_t key_hash_span(uint64_t, size_t, uint64_t, size_t);
+size_t	 key_slot(uint64_t, size_t);
+size_t	 slots_find(const uint32_t *, size_t, uint64_t,
+		int (*)(const void *, size_t), const void *, size_t *);
+void	 slots_reserve(struct slots *, size_t, size_t,
+		uint64_t (*)(const void *, size_t), const void *);
+void	 slots_free(struct slots *);
+void	 xliff_index(struct xparse *);
+int	 xliff_lookup(const struct xparse *, 
+		const struct fragkey *, size_t *, struct ftarget *);
+void	 xliff_stats(const struct hout *);
+int	 xliff_target(const struct xparse *, size_t, struct ftarget *);
+
+int	 catalog_write(struct xparse *, const char *);
+int	 catalog_open(struct xparse *, const char *, int);
+int	 catalog_lookup(const struct catmap *,
+		const struct fragkey *, size_t *, struct ftarget *);
+void	 catalog_close(struct catmap *);
+
+int	 map_open(const char *, size_t *, char **);
+void	 map_close(int, void *, size_t);
+char	*file_read(const char *, size_t *);
+int	 tmp_open(const char *, char **);
+
+const char *memo_get(const struct memo *, uint64_t, int,
+		const char *, size_t, size_t *);
+void	 memo_put(struct memo *, uint64_t, int,
+		const char *, size_t, const char *, size_t);
+void	 memo_free(struct memo *);
+
+void	 sink_init(struct sink *, int);
+void	 sink_write(struct sink *, const char *, size_t);
+void	 sink_puts(struct sink *, const char *);
+void	 sink_putc(struct sink *, char);
+void	 sink_attr(struct sink *, const char *, const char *);
+int	 sink_flush(struct sink *);
+void	 sink_free(struct sink *);
+
+void	 wordset_add(struct wordset *, const char *, size_t,
+		size_t, size_t, size_t);
+void	 wordset_merge(struct wordset *, struct wordset *);
+void	 wordset_free(struct wordset *);
+void	 word_seen(struct word *, size_t, size_t, size_t);
+void	 words_sort(struct hparse *);
+void	 words_finish(struct hparse *);
+const struct word *words_next(struct hparse *);
+
+void	 spill(struct hparse *);
+void	 spill_free(struct hparse *);
+void	 spill_move(struct hparse *, struct hparse *);
+
+struct inputs *inputs_alloc(const struct opts *, int, char *[]);
+size_t	 inputs_jobs(const struct inputs *, size_t);
+const char *inputs_get(struct inputs *, size_t, const char **);
+int	 inputs_claim(struct inputs *, const char *, const char *);
+int	 inputs_finish(struct inputs *);
+void	 inputs_free(struct inputs *);
+
+char	*cache_path(const char *, const char *, size_t);
+int	 cache_read(struct hparse *, const char *);
+void	 cache_write(const struct hparse *, const char *);
 
 void	 results_extract(struct hparse *, int);
 void	 results_update(struct hparse *, int, int, int);
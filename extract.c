@@ -21,12 +21,15 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #if HAVE_ERR
 # include <err.h>
 #endif
 #include <expat.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,115 +37,112 @@
 
 #include "extern.h"
 
+#define	ELEM_PHRASING	0x01 /* phrasing: withinText="yes" */
+#define	ELEM_VOID	0x02 /* self-closing, if empty */
+
 /*
- * List of HTML5 elements that are self-closing, if empty.
+ * Mapped input is parsed in chunks of this size, both because
+ * XML_Parse() takes an int length and so that what's been parsed may
+ * be released.
  */
-static	const char *elemvoid[] = {
-	"area",
-	"base",
-	"br",
-	"col",
-	"command",
-	"embed",
-	"hr",
-	"img",
-	"input",
-	"keygen",
-	"link",
-	"meta",
-	"param",
-	"source",
-	"track",
-	"wbr",
-	NULL
-};
+#define	MAP_CHUNK	(8 * 1024 * 1024)
 
 /*
- * List of phrasing content elements that are accepted as
- * withinText="yes" by default.
- * See ITS v2.0 section 2.5.3.
+ * Standard input is read directly into the parser's buffer, starting
+ * with reads of READ_MIN and growing up to READ_MAX while reads fill
+ * the buffer.
  */
-static	const char *phrasing[] = {
-	"a",
-	"abbr",
-	"area",
-	"audio",
-	"b",
-	"bdi",
-	"bdo",
-	"br",
-	"button",
-	"canvas",
-	"cite",
-	"code",
-	"data",
-	"datalist",
-	"del",
-	"dfn",
-	"em",
-	"embed",
-	"i",
-	/* "iframe", */
-	"img",
-	"input",
-	"ins",
-	"kbd",
-	"keygen",
-	"label",
-	"map",
-	"mark",
-	"math",
-	"meta", /* FIXME: only if itemprop */
-	"meter",
-	/* "noscript", */
-	"object",
-	"output",
-	"progress",
-	"q",
-	"ruby",
-	"s",
-	"samp",
-	/* "script", */
-	/* "select", */
-	"small",
-	"span",
-	"strong",
-	"sub",
-	"sup",
-	"svg",
-	/* "textarea", */
-	"time",
-	"u",
-	"var",
-	"video",
-	"wbr",
-	NULL
-};
+#define	READ_MIN	(64 * 1024)
+#define	READ_MAX	(1024 * 1024)
 
 static void
 lerr(const char *fn, XML_Parser p, const char *fmt, ...)
 	__attribute__((format(printf, 3, 4)));
 
+static void
+xerr(const struct xparse *p, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
 static void
 xend(void *dat, const XML_Char *s);
 
 static void
 xstart(void *dat, const XML_Char *s, const XML_Char **atts);
 
+/*
+ * State for an XLIFF file whose targets are only parsed when first
+ * looked up.
+ * The file is kept in memory, and each target's content is parsed
+ * from its byte range into its own table.
+ * It's a copy rather than a mapping, as the file may be changed or
+ * truncated while the catalog is still in use.
+ */
+struct	xlazy {
+	pthread_mutex_t	 mutex; /* serialises parsing targets */
+	XML_Parser	 p; /* parser for targets (or NULL) */
+	char		*map; /* file contents */
+	size_t		 mapsz; /* size of map */
+};
+
+static void
+vlerr(const char *fn, size_t line, size_t col,
+	const char *fmt, va_list ap)
+{
+
+	/* Don't interleave with other parsing threads. */
+
+	flockfile(stderr);
+	fprintf(stderr, "%s:%zu:%zu: ", fn, line, col);
+	vfprintf(stderr, fmt, ap);
+	fputc('\n', stderr);
+	funlockfile(stderr);
+}
+
 static void
 lerr(const char *fn, XML_Parser p, const char *fmt, ...)
 {
 	va_list	 ap;
 
-	fprintf(stderr, "%s:%zu:%zu: ", fn, 
-		XML_GetCurrentLineNumber(p),
-		XML_GetCurrentColumnNumber(p));
-
 	va_start(ap, fmt);
-	vfprintf(stderr, fmt, ap);
+	vlerr(fn, XML_GetCurrentLineNumber(p),
+		XML_GetCurrentColumnNumber(p), fmt, ap);
 	va_end(ap);
+}
 
-	fputc('\n', stderr);
+/*
+ * Like lerr(), but for an XLIFF file.
+ * A lazily-loaded target is parsed on its own, wrapped in <target>,
+ * so its position is shifted to that of its content in the file.
+ * This is only done for errors, so the file is scanned here.
+ */
+static void
+xerr(const struct xparse *p, const char *fmt, ...)
+{
+	va_list	 ap;
+	size_t	 i, line, col, bline = 1, bcol = 0;
+
+	line = XML_GetCurrentLineNumber(p->p);
+	col = XML_GetCurrentColumnNumber(p->p);
+
+	if (NULL != p->base) {
+		for (i = 0; i < p->baseoff; i++)
+			if ('\r' == p->base[i] || ('\n' == p->base[i] &&
+			    (0 == i || '\r' != p->base[i - 1]))) {
+				bline++;
+				bcol = 0;
+			} else if ('\n' != p->base[i] &&
+			    0x80 != (p->base[i] & 0xc0))
+				bcol++;
+		if (1 == line) {
+			line = bline;
+			col = bcol + (col > 8 ? col - 8 : 0);
+		} else
+			line += bline - 1;
+	}
+
+	va_start(ap, fmt);
+	vlerr(p->fname, line, col, fmt, ap);
+	va_end(ap);
 }
 
 static void
@@ -152,34 +152,148 @@ perr(const char *fn, XML_Parser p)
 	lerr(fn, p, "%s", XML_ErrorString(XML_GetErrorCode(p)));
 }
 
+#define	EQ(_s)	(0 == strcasecmp(s, (_s)))
+
 /*
- * Look up a given element to see if it can be "void", i.e., close
- * itself out.
- * For example, <p> is not void; <link /> is.
+ * Classify an HTML5 element (case insensitive) by switching on its
+ * first letter, then comparing with the few candidates.
+ * ELEM_VOID elements can close themselves out: for example, <p> is not
+ * void; <link /> is.
+ * ELEM_PHRASING elements are the phrasing content accepted as
+ * withinText="yes" by default: see ITS v2.0 section 2.5.3.
+ * Of these, we don't accept iframe, noscript, script, select, and
+ * textarea.
+ * FIXME: meta is phrasing only if itemprop.
  */
-static int
-xmlvoid(const XML_Char *s)
+static unsigned int
+elemflags(const XML_Char *s)
 {
-	const char	**cp;
 
-	for (cp = (const char **)elemvoid; NULL != *cp; cp++)
-		if (0 == strcasecmp(s, *cp))
-			return(1);
+	switch (tolower((unsigned char)s[0])) {
+	case 'a':
+		if ('\0' == s[1] || EQ("abbr") || EQ("audio"))
+			return ELEM_PHRASING;
+		if (EQ("area"))
+			return ELEM_PHRASING | ELEM_VOID;
+		break;
+	case 'b':
+		if ('\0' == s[1] || EQ("bdi") || 
+		    EQ("bdo") || EQ("button"))
+			return ELEM_PHRASING;
+		if (EQ("br"))
+			return ELEM_PHRASING | ELEM_VOID;
+		if (EQ("base"))
+			return ELEM_VOID;
+		break;
+	case 'c':
+		if (EQ("canvas") || EQ("cite") || EQ("code"))
+			return ELEM_PHRASING;
+		if (EQ("col") || EQ("command"))
+			return ELEM_VOID;
+		break;
+	case 'd':
+		if (EQ("data") || EQ("datalist") || 
+		    EQ("del") || EQ("dfn"))
+			return ELEM_PHRASING;
+		break;
+	case 'e':
+		if (EQ("em"))
+			return ELEM_PHRASING;
+		if (EQ("embed"))
+			return ELEM_PHRASING | ELEM_VOID;
+		break;
+	case 'h':
+		if (EQ("hr"))
+			return ELEM_VOID;
+		break;
+	case 'i':
+		if ('\0' == s[1] || EQ("ins"))
+			return ELEM_PHRASING;
+		if (EQ("img") || EQ("input"))
+			return ELEM_PHRASING | ELEM_VOID;
+		break;
+	case 'k':
+		if (EQ("kbd"))
+			return ELEM_PHRASING;
+		if (EQ("keygen"))
+			return ELEM_PHRASING | ELEM_VOID;
+		break;
+	case 'l':
+		if (EQ("label"))
+			return ELEM_PHRASING;
+		if (EQ("link"))
+			return ELEM_VOID;
+		break;
+	case 'm':
+		if (EQ("map") || EQ("mark") || 
+		    EQ("math") || EQ("meter"))
+			return ELEM_PHRASING;
+		if (EQ("meta"))
+			return ELEM_PHRASING | ELEM_VOID;
+		break;
+	case 'o':
+		if (EQ("object") || EQ("output"))
+			return ELEM_PHRASING;
+		break;
+	case 'p':
+		if (EQ("progress"))
+			return ELEM_PHRASING;
+		if (EQ("param"))
+			return ELEM_VOID;
+		break;
+	case 'q':
+		if ('\0' == s[1])
+			return ELEM_PHRASING;
+		break;
+	case 'r':
+		if (EQ("ruby"))
+			return ELEM_PHRASING;
+		break;
+	case 's':
+		if ('\0' == s[1] || EQ("samp") || EQ("small") ||
+		    EQ("span") || EQ("strong") || EQ("sub") ||
+		    EQ("sup") || EQ("svg"))
+			return ELEM_PHRASING;
+		if (EQ("source"))
+			return ELEM_VOID;
+		break;
+	case 't':
+		if (EQ("time"))
+			return ELEM_PHRASING;
+		if (EQ("track"))
+			return ELEM_VOID;
+		break;
+	case 'u':
+		if ('\0' == s[1])
+			return ELEM_PHRASING;
+		break;
+	case 'v':
+		if (EQ("var") || EQ("video"))
+			return ELEM_PHRASING;
+		break;
+	case 'w':
+		if (EQ("wbr"))
+			return ELEM_PHRASING | ELEM_VOID;
+		break;
+	default:
+		break;
+	}
 
-	return(0);
+	return 0;
 }
 
+#undef	EQ
+
 static void
 hparse_reset(struct hparse *hp)
 {
 
 	fragseq_clear(&hp->frag);
-	while (hp->stacksz > 0)
-		free(hp->stack[--hp->stacksz].name);
+	hp->stacksz = 0;
 }
 
 static struct hparse *
-hparse_alloc(XML_Parser p, enum pop op)
+hparse_alloc(XML_Parser p, enum pop op, const struct opts *o)
 {
 	struct hparse	*hp;
 
@@ -188,6 +302,11 @@ hparse_alloc(XML_Parser p, enum pop op)
 
 	hp->p = p;
 	hp->op = op;
+	hp->opts = o;
+	hp->frag.keyed = POP_JOIN == op;
+	hp->budget = o->budget;
+	hp->runmax = RUNS_MAX;
+	sink_init(&hp->render, -1);
 	return(hp);
 }
 
@@ -196,14 +315,18 @@ hparse_free(struct hparse *hp)
 {
 	size_t	 i;
 
-	while (hp->stacksz > 0)
-		free(hp->stack[--hp->stacksz].name);
+	wordset_free(&hp->words);
+	spill_free(hp);
 
-	for (i = 0; i < hp->wordsz; i++)
-		free(hp->words[i].source);
+	for (i = 0; i < hp->outsz; i++) {
+		sink_free(&hp->outs[i].out);
+		memo_free(&hp->outs[i].memo);
+	}
+	sink_free(&hp->render);
 
-	fragseq_clear(&hp->frag);
-	free(hp->words);
+	fragseq_free(&hp->frag);
+	buf_free(&hp->key);
+	free(hp->outs);
 	free(hp->lang);
 	free(hp);
 }
@@ -221,25 +344,180 @@ xparse_alloc(const char *xliff, XML_Parser p)
 	return(xp);
 }
 
-static void
+void
 xparse_free(struct xparse *xp)
 {
 	size_t	 i;
 
 	for (i = 0; i < xp->xliffsz; i++) {
 		free(xp->xliffs[i].source);
-		fragseq_clear(&xp->xliffs[i].target);
+		free(xp->xliffs[i].copy);
+	}
+
+	if (NULL != xp->cat)
+		catalog_close(xp->cat);
+
+	if (NULL != xp->lazy) {
+		for (i = 0; i < xp->xliffsz; i++)
+			if (NULL != xp->xliffs[i].tab) {
+				ftable_clear(xp->xliffs[i].tab);
+				free(xp->xliffs[i].tab);
+			}
+		if (NULL != xp->lazy->p)
+			XML_ParserFree(xp->lazy->p);
+		free(xp->lazy->map);
+		pthread_mutex_destroy(&xp->lazy->mutex);
+		free(xp->lazy);
 	}
 
-	fragseq_clear(&xp->frag);
-	fragseq_clear(&xp->target);
+	fragseq_free(&xp->frag);
+	ftable_clear(&xp->tab);
+	free(xp->target.copy);
 	free(xp->source);
 	free(xp->xliffs);
+	slots_free(&xp->idx);
 	free(xp->srclang);
 	free(xp->trglang);
 	free(xp);
 }
 
+/*
+ * A word being looked up in a wordset.
+ */
+struct	wordkey {
+	const struct wordset *ws;
+	const char	     *source; /* not NUL-terminated */
+	size_t		      sz; /* length of source */
+	uint64_t	      hash; /* key_hash() of source */
+};
+
+static int
+wordset_eq(const void *arg, size_t i)
+{
+	const struct wordkey *k = arg;
+	const struct word    *w = &k->ws->w[i];
+
+	return w->hash == k->hash &&
+		0 == strncmp(w->source, k->source, k->sz) &&
+		'\0' == w->source[k->sz];
+}
+
+static uint64_t
+wordset_hash(const void *arg, size_t i)
+{
+	const struct wordset *ws = arg;
+
+	return ws->w[i].hash;
+}
+
+/*
+ * Record "count" more occurrences of "w" at the given position.
+ * Only the earliest of a word's positions is kept, so the result
+ * doesn't depend on the order in which occurrences are seen.
+ */
+void
+word_seen(struct word *w, size_t line, size_t col, size_t count)
+{
+
+	if (line < w->line || (line == w->line && col < w->col)) {
+		w->line = line;
+		w->col = col;
+	}
+	w->count += count;
+}
+
+/*
+ * Add "count" occurrences of the word "source" of length "sz" and hash
+ * "h" at the given position, copying "source" if the word is new.
+ */
+static void
+wordset_put(struct wordset *ws, const char *source, size_t sz,
+	uint64_t h, size_t line, size_t col, size_t count)
+{
+	struct word	*w;
+	struct wordkey	 k;
+	size_t		 j;
+
+	assert(NULL != ws->idx.slot || 0 == ws->sz);
+
+	k.ws = ws;
+	k.source = source;
+	k.sz = sz;
+	k.hash = h;
+
+	slots_reserve(&ws->idx, ws->sz + 1, 10, wordset_hash, ws);
+	j = slots_find(ws->idx.slot, ws->idx.bits,
+		h, wordset_eq, &k, NULL);
+	assert(SIZE_MAX != j);
+
+	if (0 != ws->idx.slot[j]) {
+		word_seen(&ws->w[ws->idx.slot[j] - 1], line, col, count);
+		return;
+	}
+
+	if (ws->sz == ws->max) {
+		ws->max = 0 == ws->max ? 512 : ws->max * 2;
+		ws->w = reallocarray(ws->w, ws->max, sizeof(struct word));
+		if (NULL == ws->w)
+			err(EXIT_FAILURE, NULL);
+	}
+
+	w = &ws->w[ws->sz];
+	if (NULL == (w->source = strndup(source, sz)))
+		err(EXIT_FAILURE, NULL);
+	w->hash = h;
+	w->line = line;
+	w->col = col;
+	w->count = count;
+	ws->idx.slot[j] = ++ws->sz;
+
+	/* Roughly: the word, its source, and its share of the index. */
+
+	ws->bytes += sizeof(struct word) + sz + 1 + 2 * sizeof(uint32_t);
+}
+
+/*
+ * Add "count" occurrences of the word "source" of length "sz" at the
+ * given position, copying it if it's not already in "ws".
+ */
+void
+wordset_add(struct wordset *ws, const char *source, size_t sz,
+	size_t line, size_t col, size_t count)
+{
+
+	wordset_put(ws, source, sz,
+		key_hash(0, source, sz), line, col, count);
+}
+
+/*
+ * Add the words of "src" to "dst", emptying "src".
+ */
+void
+wordset_merge(struct wordset *dst, struct wordset *src)
+{
+	size_t		 i;
+	struct word	*w;
+
+	for (i = 0; i < src->sz; i++) {
+		w = &src->w[i];
+		wordset_put(dst, w->source, strlen(w->source),
+			w->hash, w->line, w->col, w->count);
+	}
+	wordset_free(src);
+}
+
+void
+wordset_free(struct wordset *ws)
+{
+	size_t	 i;
+
+	for (i = 0; i < ws->sz; i++)
+		free(ws->w[i].source);
+	free(ws->w);
+	slots_free(&ws->idx);
+	memset(ws, 0, sizeof(struct wordset));
+}
+
 /*
  * We're scanning a document and want to store a source word that we'll
  * eventually be putting into a template XLIFF file.
@@ -248,8 +526,7 @@ xparse_free(struct xparse *xp)
 static int
 store(struct hparse *p)
 {
-	char	*cp = NULL;
-	int	 reduce = 0;
+	const char	*cp;
 
 	assert(POP_EXTRACT == p->op);
 	assert(NULL != p->frag.root);
@@ -261,28 +538,164 @@ store(struct hparse *p)
 		return 0;
 	}
 
-	cp = frag_serialise(&p->frag, 1, &reduce);
+	cp = frag_serialise(&p->frag, 1, 1, &p->key);
 	fragseq_clear(&p->frag);
 
 	if (NULL == cp)
 		return 1;
 
-	/* Expand word list, if necessary. */
+	/* Repeated words are only counted. */
 
-	if (p->wordsz + 1 > p->wordmax) {
-		p->wordmax += 512;
-		p->words = reallocarray
-			(p->words, p->wordmax, sizeof(struct word));
-		if (NULL == p->words)
-			err(EXIT_FAILURE, NULL);
+	wordset_add(&p->words, cp, p->key.sz,
+		XML_GetCurrentLineNumber(p->p),
+		XML_GetCurrentColumnNumber(p->p), 1);
+	if (0 != p->budget && p->words.bytes > p->budget)
+		spill(p);
+	return 1;
+}
+
+/*
+ * When joining, markup that isn't rewritten is passed through from the
+ * input rather than being re-created from parse events.
+ * Write out any input not already written (or replaced) up to "end".
+ */
+static void
+hpass_flush(struct hparse *p, size_t end)
+{
+	size_t	 i;
+
+	if (NULL == p->map || end <= p->pass)
+		return;
+	for (i = 0; i < p->outsz; i++)
+		sink_write(&p->outs[i].out, 
+			p->map + p->pass, end - p->pass);
+	p->pass = end;
+}
+
+/*
+ * When passing input through, write out the input up to the current
+ * event, which is then replaced by whatever is written next.
+ */
+static void
+hpass_skip(struct hparse *p)
+{
+	size_t	 off;
+
+	if (NULL == p->map)
+		return;
+	off = XML_GetCurrentByteIndex(p->p);
+	hpass_flush(p, off);
+	p->pass = off + XML_GetCurrentByteCount(p->p);
+}
+
+/*
+ * The current event is passed through.
+ * Write out the input once a chunk of it is pending, so that it may be
+ * released (see dofile()).
+ */
+static void
+hpass_keep(struct hparse *p)
+{
+	size_t	 end;
+
+	if (NULL == p->map)
+		return;
+	end = XML_GetCurrentByteIndex(p->p) + 
+		XML_GetCurrentByteCount(p->p);
+	if (end - p->pass >= MAP_CHUNK)
+		hpass_flush(p, end);
+}
+
+/*
+ * Whether "map" may be passed through when joining.
+ * It must be UTF-8, as is our output, and mustn't have an internal DTD
+ * subset, whose entities are expanded in parse events but not in the
+ * input.
+ */
+static int
+hpass_ok(const char *map, size_t mapsz)
+{
+	const char	*cp = map, *end = map + mapsz, *e;
+	char		 quote;
+
+	if (mapsz >= 2 && 
+	    (0 == memcmp(map, "\xfe\xff", 2) || 
+	     0 == memcmp(map, "\xff\xfe", 2)))
+		return 0;
+	if (mapsz >= 3 && 0 == memcmp(map, "\xef\xbb\xbf", 3))
+		cp += 3;
+
+	/* Any declared encoding must be compatible. */
+
+	if (end - cp >= 5 && 0 == memcmp(cp, "<?xml", 5)) {
+		if (NULL == (e = memmem(cp, end - cp, "?>", 2)))
+			return 0;
+		cp = memmem(cp, e - cp, "encoding", 8);
+		if (NULL != cp) {
+			for (cp += 8; cp < e && '"' != *cp && '\'' != *cp; )
+				cp++;
+			if (e - cp < 7 || (strncasecmp(cp + 1, "utf-8", 5) &&
+			    strncasecmp(cp + 1, "us-ascii", 8)))
+				return 0;
+		}
+		cp = e + 2;
+	}
+
+	/* Look through the prolog for the document type. */
+
+	while (cp < end)
+		if (isspace((unsigned char)*cp))
+			cp++;
+		else if (end - cp >= 4 && 0 == memcmp(cp, "<!--", 4)) {
+			if (NULL == (e = memmem(cp, end - cp, "-->", 3)))
+				return 0;
+			cp = e + 3;
+		} else if (end - cp >= 2 && 0 == memcmp(cp, "<?", 2)) {
+			if (NULL == (e = memmem(cp, end - cp, "?>", 2)))
+				return 0;
+			cp = e + 2;
+		} else if (end - cp >= 9 && 0 == memcmp(cp, "<!DOCTYPE", 9)) {
+			for (quote = '\0', cp += 9; cp < end; cp++)
+				if ('\0' != quote) {
+					if (quote == *cp)
+						quote = '\0';
+				} else if ('"' == *cp || '\'' == *cp)
+					quote = *cp;
+				else if ('[' == *cp)
+					return 0;
+				else if ('>' == *cp)
+					return 1;
+			return 0;
+		} else
+			break;
+
+	return 1;
+}
+
+/*
+ * If every output has already translated the segment input "in" of
+ * length "insz", hash "h", copy out those translations.
+ * Returns zero if any hasn't.
+ */
+static int
+translate_memo(struct hparse *hp, uint64_t h, int preserve,
+	const char *in, size_t insz)
+{
+	size_t		 i, outsz;
+	const char	*out;
+
+	for (i = 0; i < hp->outsz; i++)
+		if (NULL == memo_get(&hp->outs[i].memo,
+		    h, preserve, in, insz, &outsz))
+			return 0;
+
+	for (i = 0; i < hp->outsz; i++) {
+		out = memo_get(&hp->outs[i].memo,
+			h, preserve, in, insz, &outsz);
+		sink_write(&hp->outs[i].out, out, outsz);
+		hp->outs[i].repeats++;
 	}
 
-	p->words[p->wordsz].source = cp;
-	p->words[p->wordsz].line = 
-		XML_GetCurrentLineNumber(p->p);
-	p->words[p->wordsz].col = 
-		XML_GetCurrentColumnNumber(p->p);
-	p->wordsz++;
 	return 1;
 }
 
@@ -296,9 +709,13 @@ store(struct hparse *p)
 static int
 translate(struct hparse *hp)
 {
-	char	*cp;
-	size_t	 i;
-	int	 reduce = 0, rc = 1;
+	size_t		 i, probes, insz = 0;
+	int		 rc = 1, found, preserve = 0;
+	const char	*in = NULL;
+	uint64_t	 h = 0;
+	struct fragkey	 k;
+	struct ftarget	 t;
+	struct hout	*ho;
 
 	assert(POP_JOIN == hp->op);
 	assert(hp->stack[hp->stacksz - 1].translate);
@@ -310,40 +727,82 @@ translate(struct hparse *hp)
 		return 0;
 	}
 
-	cp = frag_serialise(&hp->frag, 1, &reduce);
+	/*
+	 * If passing through, the segment's input is what's replaced,
+	 * so a repeated segment is translated as it was before.
+	 */
+
+	if (NULL != hp->map) {
+		in = hp->map + hp->pass;
+		insz = XML_GetCurrentByteIndex(hp->p) - hp->pass;
+		preserve = hp->stack[hp->stacksz - 1].preserve;
+		h = key_hash(preserve, in, insz);
+		if (translate_memo(hp, h, preserve, in, insz)) {
+			hp->pass += insz;
+			fragseq_clear(&hp->frag);
+			return 1;
+		}
+	}
+
+	/* The key is the same for all catalogs. */
 
-	if (NULL == cp) {
-		if (NULL != hp->frag.copy)
-			printf("%.*s", 
-				(int)hp->frag.copysz, 
-				hp->frag.copy);
+	if ( ! frag_key(&hp->frag, &k, &hp->key)) {
+		for (i = 0; NULL == hp->map && i < hp->outsz; i++)
+			sink_write(&hp->outs[i].out, 
+				hp->frag.copy.b, hp->frag.copy.sz);
 		fragseq_clear(&hp->frag);
 		return 1;
 	}
 
-	for (i = 0; i < hp->xp->xliffsz; i++)
-		if (0 == strcmp(hp->xp->xliffs[i].source, cp)) {
-			if (reduce)
-				frag_print_merge(&hp->frag,
-					hp->xp->xliffs[i].source,
-					&hp->xp->xliffs[i].target);
-			else
-				frag_print_merge(&hp->frag, NULL,
-					&hp->xp->xliffs[i].target);
-			free(cp);
-			fragseq_clear(&hp->frag);
-			return 1;
+	for (i = 0; i < hp->outsz; i++) {
+		ho = &hp->outs[i];
+		found = xliff_lookup(ho->xp, &k, &probes, &t);
+		ho->lookups++;
+		ho->probes += probes;
+		if (probes > ho->probemax)
+			ho->probemax = probes;
+
+		if (found && NULL == in) {
+			frag_print_merge(&ho->out, &hp->frag, &t);
+			continue;
+		} else if (found) {
+			hp->render.buf.sz = 0;
+			frag_print_merge(&hp->render, &hp->frag, &t);
+			memo_put(&ho->memo, h, preserve, in, insz,
+				hp->render.buf.b, hp->render.buf.sz);
+			sink_write(&ho->out,
+				hp->render.buf.b, hp->render.buf.sz);
+			continue;
 		}
 
-	lerr(hp->fname, hp->p, "no translation found");
+		if (1 == hp->outsz)
+			lerr(hp->fname, hp->p, 
+				"no translation found");
+		else
+			lerr(hp->fname, hp->p, "no translation "
+				"found in %s", ho->xp->fname);
 
-	if ( ! hp->copy) {
-		rc = 0;
-		XML_StopParser(hp->p, 0);
-	} else
-		printf("%s", cp);
+		if ( ! hp->opts->copy) {
+			rc = 0;
+			XML_StopParser(hp->p, 0);
+			break;
+		}
+
+		/* Only now is the key needed in full. */
+
+		if (NULL == k.key) {
+			k.key = frag_serialise
+				(&hp->frag, 1, 1, &hp->key);
+			assert(NULL != k.key && k.len == hp->key.sz);
+		}
+		sink_write(&ho->out, k.key, k.len);
+	}
+
+	/* The translation replaces the input up to here. */
+
+	if (NULL != hp->map)
+		hp->pass = XML_GetCurrentByteIndex(hp->p);
 
-	free(cp);
 	fragseq_clear(&hp->frag);
 	return rc;
 }
@@ -356,8 +815,7 @@ xtext(void *dat, const XML_Char *s, int len)
 	if (NULL != p->frag.cur &&
 	    FRAG_NODE == p->frag.cur->type &&
 	    p->frag.cur->is_null) {
-		lerr(p->fname, p->p, "content "
-			"within null element");
+		xerr(p, "content within null element");
 		XML_StopParser(p->p, 0);
 		return;
 	}
@@ -382,8 +840,7 @@ xneststart(void *dat, const XML_Char *s, const XML_Char **atts)
 	if (NULL != p->frag.cur &&
 	    FRAG_NODE == p->frag.cur->type &&
 	    p->frag.cur->is_null) {
-		lerr(p->fname, p->p, "content "
-			"within null element");
+		xerr(p, "content within null element");
 		XML_StopParser(p->p, 0);
 		return;
 	}
@@ -407,30 +864,75 @@ xnestend(void *dat, const XML_Char *s)
 	/* This is an XML file, so it's case sensitive. */
 
 	if (strcmp(s, rtype) || --p->nest > 0) {
-		frag_node_end(&p->frag, s);
+		frag_node_end(&p->frag, frag_intern(&p->frag, s));
 		return;
 	}
 
 	XML_SetElementHandler(p->p, xstart, xend);
 	XML_SetDefaultHandlerExpand(p->p, NULL);
 
+	/*
+	 * Flatten targets into our tables as we go.
+	 * If there's more than one <target>, the last wins and any
+	 * prior are left unreferenced in the tables.
+	 */
+
 	if (NEST_TARGET == p->nesttype) {
-		fragseq_clear(&p->target);
-		p->target = p->frag;
-		memset(&p->frag, 0, sizeof(struct fragseq));
-		if (NULL == p->target.root)
-			lerr(p->fname, p->p, "empty <target>");
+		free(p->target.copy);
+		p->target.copy = NULL;
+		p->target.copysz = 0;
+		frag_flatten(&p->frag, &p->tab,
+			&p->target.node, &p->target.nodesz);
+		if (p->target.nodesz) {
+			p->target.copysz = p->frag.copy.sz;
+			p->target.copy = p->frag.copy.b;
+			memset(&p->frag.copy, 0, sizeof(struct buf));
+		} else
+			xerr(p, "empty <target>");
+		fragseq_clear(&p->frag);
 	} else {
 		free(p->source);
-		p->source = strndup(p->frag.copy, p->frag.copysz);
+		p->source = strndup(p->frag.copy.b, p->frag.copy.sz);
 		if (NULL == p->source)
 			err(EXIT_FAILURE, NULL);
 		fragseq_clear(&p->frag);
 		if (NULL == p->source)
-			lerr(p->fname, p->p, "empty <source>");
+			xerr(p, "empty <source>");
 	}
 }
 
+/*
+ * When loading lazily, a <target> is skipped over, only noting where
+ * its content ends.
+ */
+static void
+xskipstart(void *dat, const XML_Char *s, const XML_Char **atts)
+{
+	struct xparse	*p = dat;
+
+	if (0 == strcmp(s, "target"))
+		++p->nest;
+}
+
+static void
+xskipend(void *dat, const XML_Char *s)
+{
+	struct xparse	*p = dat;
+	size_t		 end;
+
+	if (strcmp(s, "target") || --p->nest > 0)
+		return;
+
+	XML_SetElementHandler(p->p, xstart, xend);
+
+	/* An empty element ends where it starts. */
+
+	end = XML_GetCurrentByteIndex(p->p);
+	p->target.offsz = end > p->target.off ? end - p->target.off : 0;
+	if (0 == p->target.offsz)
+		xerr(p, "empty <target>");
+}
+
 static void
 xstart(void *dat, const XML_Char *s, const XML_Char **atts)
 {
@@ -444,17 +946,17 @@ xstart(void *dat, const XML_Char *s, const XML_Char **atts)
 			if (0 == strcmp(attp[0], "version"))
 				ver = attp[1];
 		if (NULL == ver) {
-			lerr(p->fname, p->p, "<xliff> without version");
+			xerr(p, "<xliff> without version");
 			XML_StopParser(p->p, 0);
 			return;
 		} else if (strcmp(ver, "1.2")) {
-			lerr(p->fname, p->p, "<xliff> version must be 1.2");
+			xerr(p, "<xliff> version must be 1.2");
 			XML_StopParser(p->p, 0);
 			return;
 		}
 	} else if (0 == strcmp(s, "file")) {
 		if (NULL != p->srclang || NULL != p->trglang) {
-			lerr(p->fname, p->p, "<file> already invoked");
+			xerr(p, "<file> already invoked");
 			XML_StopParser(p->p, 0);
 			return;
 		}
@@ -475,6 +977,12 @@ xstart(void *dat, const XML_Char *s, const XML_Char **atts)
 		p->nesttype = NEST_SOURCE;
 		XML_SetDefaultHandlerExpand(p->p, xtext);
 		XML_SetElementHandler(p->p, xneststart, xnestend);
+	} else if (0 == strcmp(s, "target") && NULL != p->lazy) {
+		p->nest = 1;
+		p->target.off = XML_GetCurrentByteIndex(p->p) +
+			XML_GetCurrentByteCount(p->p);
+		p->target.offsz = 0;
+		XML_SetElementHandler(p->p, xskipstart, xskipend);
 	} else if (0 == strcmp(s, "target")) {
 		p->nest = 1;
 		p->nesttype = NEST_TARGET;
@@ -497,9 +1005,10 @@ xend(void *dat, const XML_Char *s)
 
 	if (0 == strcmp(s, "trans-unit")) {
 		if (NULL == p->source || 
-		    NULL == p->target.root) {
-			lerr(p->fname, p->p, "no <source> or <target>");
-			fragseq_clear(&p->target);
+		    (0 == p->target.nodesz && 0 == p->target.offsz)) {
+			xerr(p, "no <source> or <target>");
+			free(p->target.copy);
+			memset(&p->target, 0, sizeof(struct xliff));
 			free(p->source);
 			p->source = NULL;
 			return;
@@ -513,14 +1022,14 @@ xend(void *dat, const XML_Char *s)
 			if (NULL == p->xliffs)
 				err(EXIT_FAILURE, NULL);
 		}
+		p->xliffs[p->xliffsz] = p->target;
 		p->xliffs[p->xliffsz].line = 
 			XML_GetCurrentLineNumber(p->p);
 		p->xliffs[p->xliffsz].col = 
 			XML_GetCurrentColumnNumber(p->p);
 		p->xliffs[p->xliffsz].source = p->source;
-		p->xliffs[p->xliffsz].target = p->target;
 		p->source = NULL;
-		memset(&p->target, 0, sizeof(struct fragseq));
+		memset(&p->target, 0, sizeof(struct xliff));
 		p->xliffsz++;
 	}
 }
@@ -537,6 +1046,7 @@ static void
 htext(void *dat, const XML_Char *s, int len)
 {
 	struct hparse	*p = dat;
+	size_t		 i;
 
 	if (NULL != p->frag.cur &&
 	    FRAG_NODE == p->frag.cur->type &&
@@ -548,16 +1058,97 @@ htext(void *dat, const XML_Char *s, int len)
 	
 	if (0 == p->stacksz || 
 	    0 == p->stack[p->stacksz - 1].translate) {
-		if (POP_JOIN == p->op)
-			printf("%.*s", len, s);
+		if (POP_JOIN == p->op && NULL != p->map)
+			hpass_keep(p);
+		else if (POP_JOIN == p->op)
+			for (i = 0; i < p->outsz; i++)
+				sink_write(&p->outs[i].out, s, len);
 		return;
 	}
 
+	/* The input is passed through up to the translation. */
+
+	if (NULL == p->frag.root)
+		hpass_flush(p, XML_GetCurrentByteIndex(p->p));
+
 	assert(len >= 0);
 	frag_node_text(&p->frag, s, (size_t)len,
 		p->stack[p->stacksz - 1].preserve);
 }
 
+/*
+ * Compare element names interned with frag_intern(), which folds case
+ * as HTML5 is case insensitive.
+ */
+static int
+nameeq(const char *a, const char *b)
+{
+
+	return a == b;
+}
+
+/*
+ * Echo an element we're translating into one of the outputs.
+ * Don't emit "its:translate", "xml:space", or the xmlns:its
+ * declaration.
+ * FIXME: make this optional.
+ * Make sure we accomodate for void elements.
+ */
+static void
+hstart_echo(const struct hparse *p, struct hout *ho,
+	const XML_Char *s, const XML_Char **atts, int isvoid)
+{
+	const XML_Char	**attp;
+	const char	 *trglang = ho->xp->trglang;
+
+	sink_putc(&ho->out, '<');
+	sink_puts(&ho->out, s);
+	for (attp = atts; NULL != *attp; attp += 2) {
+		if (0 == strcasecmp(s, "html") &&
+		    0 == strcasecmp(attp[0], "xmlns:its"))
+			continue;
+		if (0 == strcasecmp(attp[0], "its:translate"))
+			continue;
+		if (0 == strcasecmp(attp[0], "xml:space"))
+			continue;
+		if (0 == strcasecmp(s, "html") &&
+		    0 == strcasecmp(attp[0], "lang") &&
+		    NULL == trglang)
+			continue;
+		if (0 == strcasecmp(s, "html") &&
+		    0 == strcasecmp(attp[0], "lang") &&
+		    NULL != trglang) {
+			sink_attr(&ho->out, "lang", trglang);
+			continue;
+		}
+		sink_attr(&ho->out, attp[0], attp[1]);
+	}
+	if (0 == strcasecmp(s, "html") &&
+	    NULL == p->lang &&
+	    NULL != trglang) 
+		sink_attr(&ho->out, "lang", trglang);
+	if (isvoid)
+		sink_putc(&ho->out, '/');
+	sink_putc(&ho->out, '>');
+}
+
+/*
+ * Whether hstart_echo() would rewrite the element "s".
+ */
+static int
+hstart_rewrites(const XML_Char *s, const XML_Char **atts)
+{
+	const XML_Char	**attp;
+
+	if (0 == strcasecmp(s, "html"))
+		return 1;
+	for (attp = atts; NULL != *attp; attp += 2)
+		if (0 == strcasecmp(attp[0], "its:translate") ||
+		    0 == strcasecmp(attp[0], "xml:space"))
+			return 1;
+	return 0;
+}
+
 /*
  * Start an element in a document we're translating or extracting.
  */
@@ -566,9 +1157,12 @@ hstart(void *dat, const XML_Char *s, const XML_Char **atts)
 {
 	struct hparse	 *p = dat;
 	const XML_Char	**attp;
-	int		  dotrans = 0, preserve = 0, phrase = 0;
-	const char	**elems;
+	int		  dotrans = 0, preserve = 0;
+	unsigned int	  flags;
+	size_t		  i;
+	const char	 *name, *raw;
 	const char	 *its = NULL;
+	int		  rawsz, empty;
 
 	if (0 == strcasecmp(s, "xliff")) {
 		lerr(p->fname, p->p, 
@@ -578,13 +1172,14 @@ hstart(void *dat, const XML_Char *s, const XML_Char **atts)
 		return;
 	}
 
-	/* 
+	/*
 	 * Warn if we don't have the correct XML namespace.
 	 * FIXME: we should really only start translating within the
 	 * declared ITS namespace, not for the whole document.
 	 */
 
 	if (0 == strcasecmp(s, "html")) {
+		p->html = 1;
 		free(p->lang);
 		p->lang = NULL;
 		for (attp = atts; NULL != *attp; attp += 2) 
@@ -610,14 +1205,10 @@ hstart(void *dat, const XML_Char *s, const XML_Char **atts)
 	 * buffer and do no further processing.
 	 */
 
-	if (p->stacksz && p->stack[p->stacksz - 1].translate)
-		for (elems = phrasing; NULL != *elems; elems++)
-			if (0 == strcasecmp(s, *elems)) {
-				phrase = 1;
-				break;
-			}
+	flags = elemflags(s);
 
-	if (phrase) {
+	if (p->stacksz && p->stack[p->stacksz - 1].translate &&
+	    (ELEM_PHRASING & flags)) {
 		if (NULL != p->frag.cur &&
 		    FRAG_NODE == p->frag.cur->type &&
 		    p->frag.cur->is_null) {
@@ -626,11 +1217,11 @@ hstart(void *dat, const XML_Char *s, const XML_Char **atts)
 			XML_StopParser(p->p, 0);
 			return;
 		}
-		frag_node_start(&p->frag, s, atts, xmlvoid(s));
-		
-		/* HTML5 is case insensitive. */
-
-		if (0 == strcasecmp(s, p->stack[p->stacksz - 1].name))
+		if (NULL == p->frag.root)
+			hpass_flush(p, XML_GetCurrentByteIndex(p->p));
+		frag_node_start(&p->frag, s, atts, ELEM_VOID & flags);
+		name = p->frag.cur->name;
+		if (nameeq(name, p->stack[p->stacksz - 1].name))
 			p->stack[p->stacksz - 1].nested++;
 		return;
 	}
@@ -647,50 +1238,29 @@ hstart(void *dat, const XML_Char *s, const XML_Char **atts)
 
 	/*
 	 * If we're translating, then echo the tags.
-	 * Don't emit "its:translate", "xml:space", or the xmlns:its
-	 * declaration.
-	 * FIXME: make this optional.
-	 * Make sure we accomodate for void elements.
+	 * If passing through, this is only needed if they're changed
+	 * or are void but not empty-element tags (see hend()).
+	 * An empty-element tag is echoed as one.
 	 */
 
-	if (POP_JOIN == p->op) {
-		printf("<%s", s);
-		for (attp = atts; NULL != *attp; attp += 2) {
-			if (POP_JOIN == p->op &&
-			    0 == strcasecmp(s, "html") &&
-			    0 == strcasecmp(attp[0], "xmlns:its"))
-				continue;
-			if (POP_JOIN == p->op &&
-			    0 == strcasecmp(attp[0], "its:translate"))
-				continue;
-			if (POP_JOIN == p->op &&
-			    0 == strcasecmp(attp[0], "xml:space"))
-				continue;
-			if (POP_JOIN == p->op &&
-			    0 == strcasecmp(s, "html") &&
-			    0 == strcasecmp(attp[0], "lang") &&
-			    NULL == p->xp->trglang)
-				continue;
-			if (POP_JOIN == p->op &&
-			    0 == strcasecmp(s, "html") &&
-			    0 == strcasecmp(attp[0], "lang") &&
-			    NULL != p->xp->trglang) {
-				printf(" lang=\"%s\"", p->xp->trglang);
-				continue;
-			}
-			printf(" %s=\"%s\"", attp[0], attp[1]);
-		}
-		if (POP_JOIN == p->op &&
-		    0 == strcasecmp(s, "html") &&
-		    NULL == p->lang &&
-		    NULL != p->xp->trglang) 
-			printf(" lang=\"%s\"", p->xp->trglang);
-		if (xmlvoid(s))
-			putchar('/');
-		putchar('>');
-	}
+	if (POP_JOIN == p->op && NULL != p->map) {
+		raw = p->map + XML_GetCurrentByteIndex(p->p);
+		rawsz = XML_GetCurrentByteCount(p->p);
+		empty = rawsz >= 2 && '/' == raw[rawsz - 2];
+		if (hstart_rewrites(s, atts) || 
+		    ((ELEM_VOID & flags) && ! empty)) {
+			hpass_skip(p);
+			for (i = 0; i < p->outsz; i++)
+				hstart_echo(p, &p->outs[i], s, atts, 
+					(ELEM_VOID & flags) || empty);
+		} else
+			hpass_keep(p);
+	} else if (POP_JOIN == p->op)
+		for (i = 0; i < p->outsz; i++)
+			hstart_echo(p, &p->outs[i], 
+				s, atts, ELEM_VOID & flags);
 
-	/* 
+	/*
 	 * Check if we should begin translating.
 	 * These attributes are case insensitive. 
 	 */
@@ -721,9 +1291,11 @@ hstart(void *dat, const XML_Char *s, const XML_Char **atts)
 	 * (Note that HTML5 is case insensitive.)
 	 */
 
+	name = frag_intern(&p->frag, s);
+
 	if (0 == dotrans && 0 == preserve) {
 		assert(p->stacksz > 0);
-		if (0 == strcasecmp(s, p->stack[p->stacksz - 1].name))
+		if (nameeq(name, p->stack[p->stacksz - 1].name))
 			p->stack[p->stacksz - 1].nested++;
 		return;
 	}
@@ -742,8 +1314,7 @@ hstart(void *dat, const XML_Char *s, const XML_Char **atts)
 	 * as the existing one, just increment our nestedness.
 	 */
 
-	if (NULL == (p->stack[p->stacksz].name = strdup(s)))
-		err(EXIT_FAILURE, NULL);
+	p->stack[p->stacksz].name = name;
 
 	p->stack[p->stacksz].translate = 1 == dotrans;
 	p->stack[p->stacksz].preserve = 1 == preserve;
@@ -763,8 +1334,10 @@ static void
 hend(void *dat, const XML_Char *s)
 {
 	struct hparse	 *p = dat;
-	const char	**elems;
-	int 		  phrase = 0, end = 0;
+	const char	 *name;
+	int 		  phrase, end;
+	unsigned int	  flags;
+	size_t		  i;
 	XML_ParsingStatus st;
 
 	XML_GetParsingStatus(p->p, &st);
@@ -773,22 +1346,20 @@ hend(void *dat, const XML_Char *s)
 
 	assert(p->stacksz > 0);
 
-	/* 
+	/*
 	 * Set if we're at the end of our current scope.
 	 * Note that we're case insensitive.
 	 */
 
-	end = 0 == strcasecmp(p->stack[p->stacksz - 1].name, s) && 
+	name = frag_intern(&p->frag, s);
+	end = nameeq(p->stack[p->stacksz - 1].name, name) && 
 		0 == p->stack[p->stacksz - 1].nested;
 
 	/* Set if we're ending a phrasing element in a translation. */
 
-	if (p->stack[p->stacksz - 1].translate)
-		for (elems = phrasing; NULL != *elems; elems++)
-			if (0 == strcasecmp(s, *elems)) {
-				phrase = 1;
-				break;
-			}
+	flags = elemflags(s);
+	phrase = p->stack[p->stacksz - 1].translate &&
+		(ELEM_PHRASING & flags);
 
 	/*
 	 * If we're not ending a scope and we have phrasing content in a
@@ -796,13 +1367,13 @@ hend(void *dat, const XML_Char *s)
 	 */
 
 	if (0 == end && phrase) {
-		frag_node_end(&p->frag, s);
-		if (0 == strcasecmp(p->stack[p->stacksz - 1].name, s))
+		frag_node_end(&p->frag, name);
+		if (nameeq(p->stack[p->stacksz - 1].name, name))
 			p->stack[p->stacksz - 1].nested--;
 		return;
 	}
 
-	/* 
+	/*
 	 * We've ended an element that might have contained content that
 	 * we want to translate.
 	 * First, flush any existing translatable content.
@@ -816,26 +1387,39 @@ hend(void *dat, const XML_Char *s)
 			return;
 	}
 
-	/* Echo if we're translating unless we've already closed. */
+	/*
+	 * Echo if we're translating unless we've already closed.
+	 * If passing through, void elements have been closed already
+	 * (see hstart()), so their end tags are dropped.
+	 */
 
-	if (POP_JOIN == p->op && ! xmlvoid(s))
-		printf("</%s>", s);
+	if (POP_JOIN == p->op && NULL != p->map) {
+		if (ELEM_VOID & flags)
+			hpass_skip(p);
+		else
+			hpass_keep(p);
+	} else if (POP_JOIN == p->op && ! (ELEM_VOID & flags))
+		for (i = 0; i < p->outsz; i++) {
+			sink_write(&p->outs[i].out, "</", 2);
+			sink_puts(&p->outs[i].out, s);
+			sink_putc(&p->outs[i].out, '>');
+		}
 
-	/* 
+	/*
 	 * Check if we're closing a translation context.
 	 * If we are, decrement nesting.
 	 * Otherwise, free the saved context name and pop context.
 	 */
 
-	if (strcasecmp(p->stack[p->stacksz - 1].name, s))
+	if ( ! nameeq(p->stack[p->stacksz - 1].name, name))
 		return;
 	if (0 == p->stack[p->stacksz - 1].nested)
-		free(p->stack[--p->stacksz].name);
+		p->stacksz--;
 	else
 		p->stack[p->stacksz - 1].nested--;
 }
 
-static int
+int
 map_open(const char *fn, size_t *mapsz, char **map)
 {
 	struct stat	 st;
@@ -852,7 +1436,7 @@ map_open(const char *fn, size_t *mapsz, char **map)
 		fprintf(stderr, "%s: not regular\n", fn);
 		close(fd);
 		return(-1);
-	} else if (st.st_size >= (1U << 31)) {
+	} else if ((uintmax_t)st.st_size > SIZE_MAX) {
 		fprintf(stderr, "%s: too large\n", fn);
 		close(fd);
 		return(-1);
@@ -870,7 +1454,7 @@ map_open(const char *fn, size_t *mapsz, char **map)
 	return(fd);
 }
 
-static void
+void
 map_close(int fd, void *map, size_t mapsz)
 {
 
@@ -879,110 +1463,1130 @@ map_close(int fd, void *map, size_t mapsz)
 }
 
 /*
- * Given a file buffer and the file buffer size, invoke the XML parser
- * on the buffer for scanning.
- * Accomodate for NULL maps (read directly from stdin).
+ * Like map_open(), but read the file "fn" into memory of its own, for
+ * when it must be kept even if the file then changes.
+ * Returns NULL on failure (after reporting the error).
  */
-static int
-dofile(struct hparse *hp, const char *map, size_t mapsz)
+char *
+file_read(const char *fn, size_t *bufsz)
 {
-	char 	 b[4096];
-	ssize_t	 sz;
-	int 	 rc = XML_STATUS_OK;
+	struct stat	 st;
+	char		*buf;
+	size_t		 sz = 0;
+	ssize_t		 ssz;
+	int		 fd;
 
-	XML_ParserReset(hp->p, NULL);
-	XML_SetDefaultHandlerExpand(hp->p, htext);
-	XML_SetElementHandler(hp->p, hstart, hend);
-	XML_SetUserData(hp->p, hp);
+	if (-1 == (fd = open(fn, O_RDONLY))) {
+		perror(fn);
+		return NULL;
+	} else if (-1 == fstat(fd, &st)) {
+		perror(fn);
+		close(fd);
+		return NULL;
+	} else if ( ! S_ISREG(st.st_mode)) {
+		fprintf(stderr, "%s: not regular\n", fn);
+		close(fd);
+		return NULL;
+	} else if ((uintmax_t)st.st_size >= SIZE_MAX) {
+		fprintf(stderr, "%s: too large\n", fn);
+		close(fd);
+		return NULL;
+	}
+
+	if (NULL == (buf = malloc(st.st_size + 1)))
+		err(EXIT_FAILURE, NULL);
+
+	/* The file may be shrinking: use what's there. */
+
+	while (sz < (size_t)st.st_size) {
+		ssz = read(fd, buf + sz, st.st_size - sz);
+		if (-1 == ssz && EINTR == errno)
+			continue;
+		if (-1 == ssz) {
+			perror(fn);
+			close(fd);
+			free(buf);
+			return NULL;
+		} else if (0 == ssz)
+			break;
+		sz += ssz;
+	}
+
+	close(fd);
+	*bufsz = sz;
+	return buf;
+}
+
+static pthread_once_t	 tmp_once = PTHREAD_ONCE_INIT;
+static mode_t		 tmp_mode;
+
+static void
+tmp_init(void)
+{
+	mode_t	 um;
+
+	um = umask(0);
+	umask(um);
+	tmp_mode = 0666 & ~um;
+}
+
+/*
+ * Create a temporary file alongside "fname", to be renamed over it
+ * once complete.
+ * Sets "tmp" to the temporary file's name, which must be freed.
+ * Returns the open file descriptor or -1 on failure.
+ */
+int
+tmp_open(const char *fname, char **tmp)
+{
+	int	 fd;
+
+	/* umask(2) isn't thread-safe, so only query it once. */
+
+	pthread_once(&tmp_once, tmp_init);
+
+	if (-1 == asprintf(tmp, "%s.XXXXXXXXXX", fname))
+		err(EXIT_FAILURE, NULL);
+
+	if (-1 == (fd = mkstemp(*tmp))) {
+		perror(*tmp);
+		free(*tmp);
+		*tmp = NULL;
+		return -1;
+	}
+
+	/* mkstemp(3) creates with 0600: use the usual mode. */
+
+	if (-1 == fchmod(fd, tmp_mode))
+		perror(*tmp);
+
+	return fd;
+}
+
+/*
+ * Expand the output file template for the input "fname" translated
+ * into "ho" into a path within the output directory.
+ * The directories of "sub", the input's path within its -R directory,
+ * are kept.
+ * Returns NULL on failure (after reporting it).
+ */
+static char *
+outname(const struct hparse *hp, const struct hout *ho,
+	const char *fname, const char *sub)
+{
+	const char	*cp, *base, *suf;
+	char		*buf = NULL;
+	size_t		 bufsz = 0;
+	FILE		*f;
+
+	if (NULL == (f = open_memstream(&buf, &bufsz)))
+		err(EXIT_FAILURE, NULL);
+
+	if (NULL != (base = strrchr(fname, '/')))
+		base++;
+	else
+		base = fname;
+	if (NULL == (suf = strrchr(base, '.')) || suf == base)
+		suf = base + strlen(base);
+
+	fprintf(f, "%s/", hp->opts->outdir);
+	fwrite(sub, 1, base - sub, f);
 
-	if (NULL == map) {
-		do {
-			sz = read(STDIN_FILENO, b, sizeof(b));
-			if (sz < 0) {
-				perror(hp->fname);
+	for (cp = hp->opts->outtmpl; '\0' != *cp; cp++) {
+		if ('%' != *cp) {
+			putc(*cp, f);
+			continue;
+		}
+		switch (*++cp) {
+		case 'b':
+			fwrite(base, 1, suf - base, f);
+			break;
+		case 'f':
+			fputs(base, f);
+			break;
+		case 'l':
+			if (NULL != ho->xp->trglang) {
+				fputs(ho->xp->trglang, f);
 				break;
 			}
-			rc = XML_Parse(hp->p, b, sz, sz == 0);
-		} while (XML_STATUS_OK == rc && sz > 0);
+			fprintf(stderr, "%s: no target "
+				"language for %%l\n", ho->xp->fname);
+			fclose(f);
+			free(buf);
+			return NULL;
+		case '%':
+			putc('%', f);
+			break;
+		default:
+			fprintf(stderr, "%s: bad output "
+				"template\n", hp->opts->outtmpl);
+			fclose(f);
+			free(buf);
+			return NULL;
+		}
+	}
+
+	if (EOF == fclose(f))
+		err(EXIT_FAILURE, NULL);
+	return buf;
+}
+
+/*
+ * Create the directories of the output file "path" not already
+ * existing after its first "from" bytes.
+ * Returns zero on failure (after reporting it).
+ */
+static int
+outdirs(char *path, size_t from)
+{
+	char	*cp;
+	int	 rc = 1;
+
+	for (cp = path + from; rc && NULL != (cp = strchr(cp, '/')); ) {
+		*cp = '\0';
+		if (-1 == mkdir(path, 0777) && EEXIST != errno) {
+			perror(path);
+			rc = 0;
+		}
+		*cp++ = '/';
+	}
+
+	return rc;
+}
+
+/*
+ * Parse "map" in chunks with "p".
+ */
+static enum XML_Status
+map_parse(XML_Parser p, const char *map, size_t mapsz)
+{
+	size_t		 off = 0, sz;
+	enum XML_Status	 rc;
+
+	do {
+		sz = mapsz - off > MAP_CHUNK ? MAP_CHUNK : mapsz - off;
+		rc = XML_Parse(p, map + off, sz, off + sz == mapsz);
+		off += sz;
+	} while (XML_STATUS_OK == rc && off < mapsz);
+
+	return rc;
+}
+
+/*
+ * Parse standard input with "p".
+ * Returns zero on failure (after reporting it).
+ */
+static int
+dostdin(XML_Parser p, const char *fname)
+{
+#ifdef F_SETPIPE_SZ
+	struct stat	 st;
+#endif
+	void		*b;
+	size_t		 bsz = READ_MIN;
+	ssize_t		 sz;
 
-		if (XML_STATUS_OK != rc)
-			perr(hp->fname, hp->p);
-		if (XML_STATUS_OK == rc && 0 == sz)
+#ifdef F_SETPIPE_SZ
+	/* Fewer, larger writes from whatever's feeding us. */
+
+	if (-1 != fstat(STDIN_FILENO, &st) && S_ISFIFO(st.st_mode))
+		fcntl(STDIN_FILENO, F_SETPIPE_SZ, READ_MAX);
+#endif
+
+	for (;;) {
+		if (NULL == (b = XML_GetBuffer(p, bsz))) {
+			perr(fname, p);
+			return 0;
+		}
+		if (-1 == (sz = read(STDIN_FILENO, b, bsz))) {
+			if (EINTR == errno)
+				continue;
+			perror(fname);
+			return 0;
+		}
+		if (XML_STATUS_OK != XML_ParseBuffer(p, sz, 0 == sz)) {
+			perr(fname, p);
+			return 0;
+		}
+		if (0 == sz)
 			return 1;
-	} else {
-		if (XML_STATUS_OK == XML_Parse(hp->p, map, mapsz, 1))
+		if ((size_t)sz == bsz && bsz < READ_MAX)
+			bsz *= 2;
+	}
+}
+
+/*
+ * Read all of standard input into "b", for when it must be kept whole.
+ * Returns zero on failure (after reporting it).
+ */
+static int
+stdin_read(const char *fname, struct buf *b)
+{
+	char	 in[READ_MIN];
+	ssize_t	 sz;
+
+	for (;;) {
+		if (-1 == (sz = read(STDIN_FILENO, in, sizeof(in)))) {
+			if (EINTR == errno)
+				continue;
+			perror(fname);
+			return 0;
+		} else if (0 == sz)
 			return 1;
+		buf_append(b, in, sz);
+	}
+}
+
+/*
+ * Given a file buffer and the file buffer size, invoke the XML parser
+ * on the buffer for scanning.
+ * Accomodate for NULL maps (read directly from stdin).
+ * If "mapped", "map" is a mapping of which what's been parsed (and
+ * written, if passed through) is released as parsing progresses, so
+ * large inputs needn't be resident.
+ * The pages are discarded rather than unmapped: the caller unmaps the
+ * whole, and a hole could meanwhile be mapped by another thread.
+ */
+static int
+dofile(struct hparse *hp, const char *map, size_t mapsz, int mapped)
+{
+	size_t	 off, chunk, done, released = 0, pagesz;
+	int 	 rc = XML_STATUS_OK;
+
+	XML_ParserReset(hp->p, NULL);
+	XML_SetDefaultHandlerExpand(hp->p, htext);
+	XML_SetElementHandler(hp->p, hstart, hend);
+	XML_SetUserData(hp->p, hp);
+
+	hp->map = NULL;
+	hp->pass = 0;
+	if (POP_JOIN == hp->op && NULL != map && hpass_ok(map, mapsz))
+		hp->map = map;
+
+	if (NULL == map)
+		return dostdin(hp->p, hp->fname);
+
+	if (mapped)
+		madvise((void *)map, mapsz, MADV_SEQUENTIAL);
+	pagesz = sysconf(_SC_PAGESIZE);
+	off = 0;
+	do {
+		chunk = mapsz - off > MAP_CHUNK ? MAP_CHUNK : mapsz - off;
+		rc = XML_Parse(hp->p, 
+			map + off, chunk, off + chunk == mapsz);
+		off += chunk;
+		if ( ! mapped || off == mapsz)
+			continue;
+
+		/* Expat keeps its own copy of partial input. */
+
+		done = NULL != hp->map && hp->pass < off ?
+			hp->pass : off;
+		done -= done % pagesz;
+		if (done > released) {
+			madvise((void *)(map + released), 
+				done - released, MADV_DONTNEED);
+			released = done;
+		}
+	} while (XML_STATUS_OK == rc && off < mapsz);
+
+	if (XML_STATUS_OK == rc)
+		hpass_flush(hp, mapsz);
+	else
 		perr(hp->fname, hp->p);
+
+	hp->map = NULL;
+	return XML_STATUS_OK == rc;
+}
+
+/*
+ * Like dofile(), but when extracting with a cache, first look for the
+ * file's words there and skip parsing if they're found.
+ * Otherwise, the words are cached once parsed.
+ */
+static int
+dofile_cached(struct hparse *hp, const char *map, size_t mapsz)
+{
+	char		*path;
+	struct wordset	 words;
+	size_t		 spills;
+	int		 rc = 1;
+
+	if (POP_EXTRACT != hp->op || NULL == hp->opts->cache)
+		return dofile(hp, map, mapsz, 1);
+
+	path = cache_path(hp->opts->cache, map, mapsz);
+	if ( ! cache_read(hp, path)) {
+
+		/* Scan into an empty set to cache only this file's. */
+
+		words = hp->words;
+		memset(&hp->words, 0, sizeof(struct wordset));
+		spills = hp->spills;
+		hp->html = 0;
+		rc = dofile(hp, map, mapsz, 1);
+
+		/* If some were spilled, we can't cache the file. */
+
+		if (rc && spills == hp->spills)
+			cache_write(hp, path);
+		wordset_merge(&words, &hp->words);
+		hp->words = words;
 	}
 
-	return 0;
+	if (0 != hp->budget && hp->words.bytes > hp->budget)
+		spill(hp);
+
+	free(path);
+	return rc;
+}
+
+/*
+ * Invoke the HTML5 parser on a single file of "in", whose path within
+ * its -R directory is "sub".
+ * If we're translating into an output directory, write each output
+ * into a new file there.
+ * The new files only replace any existing ones if we succeed, and
+ * only one input may write each file.
+ */
+static int
+scanfile(struct hparse *hp, struct inputs *in,
+	const char *fname, const char *sub)
+{
+	int		 fd, tfd, rc = 1;
+	char		*map, **paths = NULL, **tmps = NULL;
+	size_t		 i, mapsz;
+	struct hout	*ho;
+
+	if (-1 == (fd = map_open(fname, &mapsz, &map)))
+		return 0;
+
+	if (POP_JOIN == hp->op && NULL != hp->opts->outdir) {
+		paths = calloc(hp->outsz, sizeof(char *));
+		tmps = calloc(hp->outsz, sizeof(char *));
+		if (NULL == paths || NULL == tmps)
+			err(EXIT_FAILURE, NULL);
+		for (i = 0; rc && i < hp->outsz; i++) {
+			ho = &hp->outs[i];
+			if (NULL == (paths[i] =
+			     outname(hp, ho, fname, sub)) ||
+			    ! inputs_claim(in, paths[i], fname) ||
+			    ! outdirs(paths[i],
+			     strlen(hp->opts->outdir) + 1) ||
+			    -1 == (tfd = tmp_open(paths[i], &tmps[i])))
+				rc = 0;
+			else
+				sink_init(&ho->out, tfd);
+		}
+	}
+
+	if (rc) {
+		hp->fname = fname;
+		rc = dofile_cached(hp, map, mapsz);
+	}
+	map_close(fd, map, mapsz);
+	hparse_reset(hp);
+
+	if (NULL == paths)
+		return rc;
+
+	for (i = 0; i < hp->outsz; i++) {
+		ho = &hp->outs[i];
+		if (-1 == ho->out.fd)
+			continue;
+		if ( ! sink_flush(&ho->out) || -1 == close(ho->out.fd)) {
+			perror(tmps[i]);
+			rc = 0;
+		}
+		sink_free(&ho->out);
+		sink_init(&ho->out, -1);
+	}
+
+	for (i = 0; i < hp->outsz; i++) {
+		if (NULL != tmps[i]) {
+			if (rc && -1 == rename(tmps[i], paths[i])) {
+				perror(paths[i]);
+				rc = 0;
+			}
+			if ( ! rc)
+				unlink(tmps[i]);
+		}
+		free(tmps[i]);
+		free(paths[i]);
+	}
+
+	free(tmps);
+	free(paths);
+	return rc;
 }
 
 /*
  * Invoke the HTML5 parser on a series of files; or if no files are
  * specified, as read from standard input.
+ * When joining, standard input that can't be mapped is read whole, so
+ * that markup is passed through just as it is from files.
  */
 static int
-scanner(struct hparse *hp, int argc, char *argv[])
+scanner(struct hparse *hp, struct inputs *in)
 {
-	int		 i, fd, rc;
-	char		*map;
-	size_t		 mapsz;
+	const char	*fname, *sub;
+	size_t		 i;
+	int		 rc;
+	struct stat	 st;
+	struct buf	 b;
+	void		*map;
 
-	if (0 == argc) {
+	if (NULL == in) {
 		hp->fname = "<stdin>";
-		return(dofile(hp, NULL, 0));
+
+		/* If we've been given a file, map it as if named. */
+
+		if (-1 != fstat(STDIN_FILENO, &st) && 
+		    S_ISREG(st.st_mode) && st.st_size > 0 &&
+		    (uintmax_t)st.st_size <= SIZE_MAX &&
+		    0 == lseek(STDIN_FILENO, 0, SEEK_CUR)) {
+			map = mmap(NULL, st.st_size, PROT_READ, 
+				MAP_SHARED, STDIN_FILENO, 0);
+			if (MAP_FAILED != map) {
+				rc = dofile(hp, map, st.st_size, 1);
+				munmap(map, st.st_size);
+				return rc;
+			}
+		}
+		if (POP_JOIN != hp->op)
+			return(dofile(hp, NULL, 0, 0));
+		memset(&b, 0, sizeof(struct buf));
+		if ((rc = stdin_read(hp->fname, &b)))
+			rc = dofile(hp, NULL == b.b ? "" : b.b, b.sz, 0);
+		buf_free(&b);
+		return rc;
 	}
 
-	for (i = 0; i < argc; i++) {
-		if (-1 == (fd = map_open(argv[i], &mapsz, &map)))
-			break;
-		hp->fname = argv[i];
-		rc = dofile(hp, map, mapsz);
-		map_close(fd, map, mapsz);
-		hparse_reset(hp);
-		if (0 == rc)
+	for (i = 0; NULL != (fname = inputs_get(in, i, &sub)); i++)
+		if ( ! scanfile(hp, in, fname, sub))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * A file being translated by a pjoin() worker or scanned by a
+ * pextract() worker.
+ */
+struct	pfile {
+	char		*buf; /* translated output */
+	size_t		 bufsz; /* length of output */
+	int		 done; /* whether parsed */
+	int		 rc; /* whether parse succeeded */
+	int		 html; /* if scanned, whether <html> seen */
+	char		*lang; /* if scanned, its language */
+};
+
+/*
+ * State shared between pjoin() workers.
+ * All fields are protected by the mutex.
+ * Files may still be being found, so the per-file results grow as
+ * files are parsed.
+ */
+struct	pool {
+	pthread_mutex_t	     mutex;
+	struct hparse	    *hp; /* template for worker parses */
+	struct pfile	    *files; /* per-file results */
+	size_t		     filesz; /* files parsed or being parsed */
+	size_t		     filemax; /* files buffer size */
+	struct inputs	    *in; /* files */
+	size_t		     next; /* next file to parse */
+	size_t		     emit; /* next file to emit */
+	size_t		     fail; /* first failed file or SIZE_MAX */
+	size_t		     budget; /* if scanning, budget per worker */
+	size_t		     runmax; /* if scanning, runs per worker */
+};
+
+/*
+ * Take the next file to parse, returning its index, with its name in
+ * "fname" and path within its -R directory in "sub", or SIZE_MAX if
+ * there are no more or one has failed.
+ * This waits for the file to be found, if need be.
+ */
+static size_t
+pool_next(struct pool *pl, const char **fname, const char **sub)
+{
+	size_t	 i, max;
+
+	pthread_mutex_lock(&pl->mutex);
+	if (pl->next > pl->fail) {
+		pthread_mutex_unlock(&pl->mutex);
+		return SIZE_MAX;
+	}
+	i = pl->next++;
+	pthread_mutex_unlock(&pl->mutex);
+
+	if (NULL == (*fname = inputs_get(pl->in, i, sub)))
+		return SIZE_MAX;
+
+	pthread_mutex_lock(&pl->mutex);
+	if (i >= pl->filemax) {
+		max = pl->filemax;
+		while (i >= pl->filemax)
+			pl->filemax = 0 == pl->filemax ?
+				64 : pl->filemax * 2;
+		pl->files = reallocarray(pl->files,
+			pl->filemax, sizeof(struct pfile));
+		if (NULL == pl->files)
+			err(EXIT_FAILURE, NULL);
+		memset(&pl->files[max], 0,
+			(pl->filemax - max) * sizeof(struct pfile));
+	}
+	if (i >= pl->filesz)
+		pl->filesz = i + 1;
+	pthread_mutex_unlock(&pl->mutex);
+	return i;
+}
+
+/*
+ * Emit all translated files that are ready, in order, stopping after
+ * the first file that failed (whose partial output is also emitted).
+ * This is what scanner() would do.
+ * Must be called with the pool locked.
+ */
+static void
+pjoin_emit(struct pool *pl)
+{
+	struct pfile	*pf;
+
+	while (pl->emit < pl->filesz && pl->emit <= pl->fail) {
+		pf = &pl->files[pl->emit];
+		if ( ! pf->done)
 			break;
+		sink_write(&pl->hp->outs[0].out, pf->buf, pf->bufsz);
+		free(pf->buf);
+		pf->buf = NULL;
+		pl->emit++;
+	}
+}
+
+/*
+ * Worker for pjoin().
+ * Each worker has its own parser and parse state, sharing only the
+ * (read-only) dictionary.
+ * Files are taken in order and translated into memory.
+ */
+static void *
+pjoin_worker(void *arg)
+{
+	struct pool	*pl = arg;
+	struct hparse	*hp;
+	struct hout	*ho;
+	XML_Parser	 p;
+	char		*buf;
+	const char	*fname, *sub;
+	size_t		 i, j, bufsz;
+	int		 rc;
+
+	if (NULL == (p = XML_ParserCreate(NULL)))
+		errx(EXIT_FAILURE, "XML_ParserCreate");
+
+	hp = hparse_alloc(p, pl->hp->op, pl->hp->opts);
+	hp->outsz = pl->hp->outsz;
+	hp->outs = calloc(hp->outsz, sizeof(struct hout));
+	if (NULL == hp->outs)
+		err(EXIT_FAILURE, NULL);
+	for (j = 0; j < hp->outsz; j++) {
+		hp->outs[j].xp = pl->hp->outs[j].xp;
+		sink_init(&hp->outs[j].out, -1);
+	}
+
+	while (SIZE_MAX != (i = pool_next(pl, &fname, &sub))) {
+		/* 
+		 * With an output directory, scanfile() writes the
+		 * files for us: we have nothing to emit.
+		 * Otherwise, there's only the one output, which is
+		 * accumulated in memory.
+		 */
+
+		rc = scanfile(hp, pl->in, fname, sub);
+		buf = NULL;
+		bufsz = 0;
+
+		if (NULL == hp->opts->outdir) {
+			assert(1 == hp->outsz);
+			buf = hp->outs[0].out.buf.b;
+			bufsz = hp->outs[0].out.buf.sz;
+			sink_init(&hp->outs[0].out, -1);
+		}
+
+		pthread_mutex_lock(&pl->mutex);
+		pl->files[i].buf = buf;
+		pl->files[i].bufsz = bufsz;
+		pl->files[i].done = 1;
+		pl->files[i].rc = rc;
+		if ( ! rc && i < pl->fail)
+			pl->fail = i;
+		pjoin_emit(pl);
+		pthread_mutex_unlock(&pl->mutex);
+	}
+
+	pthread_mutex_lock(&pl->mutex);
+	for (j = 0; j < hp->outsz; j++) {
+		ho = &pl->hp->outs[j];
+		ho->lookups += hp->outs[j].lookups;
+		ho->probes += hp->outs[j].probes;
+		if (hp->outs[j].probemax > ho->probemax)
+			ho->probemax = hp->outs[j].probemax;
+		ho->repeats += hp->outs[j].repeats;
+	}
+	pthread_mutex_unlock(&pl->mutex);
+
+	hparse_free(hp);
+	XML_ParserFree(p);
+	return NULL;
+}
+
+/*
+ * Like scanner(), but translating files with up to "jobs" threads.
+ * Output is still emitted in the order of the inputs.
+ * Lookup statistics are accumulated into the outputs of "hp".
+ */
+static int
+pjoin(struct hparse *hp, size_t jobs, struct inputs *in)
+{
+	struct pool	 pl;
+	pthread_t	*tids;
+	size_t		 i;
+	int		 er;
+
+	assert(POP_JOIN == hp->op);
+	assert(NULL != in);
+
+	memset(&pl, 0, sizeof(struct pool));
+	pl.hp = hp;
+	pl.in = in;
+	pl.fail = SIZE_MAX;
+	if (NULL == (tids = calloc(jobs, sizeof(pthread_t))))
+		err(EXIT_FAILURE, NULL);
+	if (0 != (er = pthread_mutex_init(&pl.mutex, NULL)))
+		errc(EXIT_FAILURE, er, "pthread_mutex_init");
+
+	for (i = 0; i < jobs; i++)
+		if (0 != (er = pthread_create
+		    (&tids[i], NULL, pjoin_worker, &pl)))
+			errc(EXIT_FAILURE, er, "pthread_create");
+	for (i = 0; i < jobs; i++)
+		if (0 != (er = pthread_join(tids[i], NULL)))
+			errc(EXIT_FAILURE, er, "pthread_join");
+
+	/* Files parsed after a failure are never emitted. */
+
+	for (i = 0; i < pl.filesz; i++)
+		free(pl.files[i].buf);
+
+	pthread_mutex_destroy(&pl.mutex);
+	free(pl.files);
+	free(tids);
+	return SIZE_MAX == pl.fail;
+}
+
+static int
+wordcmp(const void *p1, const void *p2)
+{
+	const struct word *w1 = p1, *w2 = p2;
+
+	return strcmp(w1->source, w2->source);
+}
+
+/*
+ * Sort the words of "hp", as expected by results_extract() and
+ * results_update().
+ * The words are already distinct, so this drops their index.
+ */
+void
+words_sort(struct hparse *hp)
+{
+
+	qsort(hp->words.w, hp->words.sz, sizeof(struct word), wordcmp);
+	slots_free(&hp->words.idx);
+}
+
+/*
+ * Two parses whose words are to be merged by words_merge().
+ */
+struct	pmerge {
+	struct hparse	*a; /* merged into */
+	struct hparse	*b; /* merged from, left empty */
+};
+
+/*
+ * Merge the sorted words of two parses.
+ * Words in both are combined as wordset_add() would.
+ */
+static void *
+words_merge(void *arg)
+{
+	struct pmerge	*pm = arg;
+	struct wordset	*a = &pm->a->words, *b = &pm->b->words;
+	struct word	*w;
+	size_t		 i = 0, j = 0, k = 0;
+	int		 c;
+
+	if (0 == b->sz)
+		return NULL;
+
+	w = reallocarray(NULL, a->sz + b->sz, sizeof(struct word));
+	if (NULL == w)
+		err(EXIT_FAILURE, NULL);
+
+	while (i < a->sz && j < b->sz) {
+		c = wordcmp(&a->w[i], &b->w[j]);
+		if (c < 0)
+			w[k++] = a->w[i++];
+		else if (c > 0)
+			w[k++] = b->w[j++];
+		else {
+			w[k] = a->w[i++];
+			word_seen(&w[k++], b->w[j].line,
+				b->w[j].col, b->w[j].count);
+			free(b->w[j++].source);
+		}
+	}
+	while (i < a->sz)
+		w[k++] = a->w[i++];
+	while (j < b->sz)
+		w[k++] = b->w[j++];
+
+	free(a->w);
+	a->w = w;
+	a->sz = a->max = k;
+	free(b->w);
+	memset(b, 0, sizeof(struct wordset));
+	return NULL;
+}
+
+/*
+ * Worker for pextract().
+ * Each worker scans files into its own words, which are sorted and
+ * de-duplicated once there are no more files.
+ * The worker's parse is returned for merging.
+ */
+static void *
+pextract_worker(void *arg)
+{
+	struct pool	*pl = arg;
+	struct hparse	*hp;
+	struct pfile	*pf;
+	XML_Parser	 p;
+	const char	*fname, *sub;
+	size_t		 i;
+	int		 rc;
+
+	if (NULL == (p = XML_ParserCreate(NULL)))
+		errx(EXIT_FAILURE, "XML_ParserCreate");
+
+	hp = hparse_alloc(p, pl->hp->op, pl->hp->opts);
+	hp->budget = pl->budget;
+	hp->runmax = pl->runmax;
+
+	while (SIZE_MAX != (i = pool_next(pl, &fname, &sub))) {
+		hp->html = 0;
+		rc = scanfile(hp, pl->in, fname, sub);
+
+		pthread_mutex_lock(&pl->mutex);
+		pf = &pl->files[i];
+		pf->done = 1;
+		pf->rc = rc;
+		pf->html = hp->html;
+		pf->lang = hp->lang;
+		hp->lang = NULL;
+		if ( ! rc && i < pl->fail)
+			pl->fail = i;
+		pthread_mutex_unlock(&pl->mutex);
+	}
+
+	words_sort(hp);
+	XML_ParserFree(p);
+	hp->p = NULL;
+	return hp;
+}
+
+/*
+ * Like scanner(), but scanning files with up to "jobs" threads, each
+ * with its share of the budget and of the open runs (one more is opened
+ * while merging).
+ * Unless any were spilled, the words are left sorted.
+ * The language is that of the last file with an <html> element, and
+ * the file name that of the last file, as if scanned in order.
+ */
+static int
+pextract(struct hparse *hp, size_t jobs, struct inputs *in)
+{
+	struct pool	  pl;
+	pthread_t	 *tids;
+	struct hparse	**hps;
+	struct pmerge	 *pms;
+	size_t		  i, n, step, spilled = 0;
+	int		  er;
+
+	assert(POP_EXTRACT == hp->op);
+	assert(NULL != in);
+
+	memset(&pl, 0, sizeof(struct pool));
+	pl.hp = hp;
+	pl.in = in;
+	pl.fail = SIZE_MAX;
+	pl.budget = 0 == hp->budget ? 0 :
+		hp->budget / jobs > 0 ? hp->budget / jobs : 1;
+	pl.runmax = RUNS_MAX / jobs > 3 ? RUNS_MAX / jobs - 1 : 2;
+	tids = calloc(jobs, sizeof(pthread_t));
+	hps = calloc(jobs, sizeof(struct hparse *));
+	pms = calloc(jobs, sizeof(struct pmerge));
+	if (NULL == tids || NULL == hps || NULL == pms)
+		err(EXIT_FAILURE, NULL);
+	if (0 != (er = pthread_mutex_init(&pl.mutex, NULL)))
+		errc(EXIT_FAILURE, er, "pthread_mutex_init");
+
+	for (i = 0; i < jobs; i++)
+		if (0 != (er = pthread_create
+		    (&tids[i], NULL, pextract_worker, &pl)))
+			errc(EXIT_FAILURE, er, "pthread_create");
+	for (i = 0; i < jobs; i++)
+		if (0 != (er = pthread_join(tids[i], (void **)&hps[i])))
+			errc(EXIT_FAILURE, er, "pthread_join");
+
+	/*
+	 * Merge pairwise, each round's merges in parallel.
+	 * There are at most jobs / 2 merges per round.
+	 */
+
+	for (i = 0; i < jobs; i++)
+		spilled += hps[i]->runsz;
+
+	for (step = 1; SIZE_MAX == pl.fail &&
+	     0 == spilled && step < jobs; step *= 2) {
+		for (n = 0, i = 0; i + step < jobs; i += 2 * step, n++) {
+			pms[n].a = hps[i];
+			pms[n].b = hps[i + step];
+			if (0 != (er = pthread_create
+			    (&tids[n], NULL, words_merge, &pms[n])))
+				errc(EXIT_FAILURE, er, "pthread_create");
+		}
+		for (i = 0; i < n; i++)
+			if (0 != (er = pthread_join(tids[i], NULL)))
+				errc(EXIT_FAILURE, er, "pthread_join");
 	}
 
-	return(i == argc);
+	if (SIZE_MAX == pl.fail && 0 == spilled) {
+		wordset_free(&hp->words);
+		hp->words = hps[0]->words;
+		memset(&hps[0]->words, 0, sizeof(struct wordset));
+	} else if (SIZE_MAX == pl.fail) {
+		/* Runs are merged when emitted: spill the rest too. */
+		for (i = 0; i < jobs; i++)
+			spill_move(hp, hps[i]);
+	}
+
+	if (SIZE_MAX == pl.fail && pl.filesz > 0)
+		hp->fname = inputs_get(in, pl.filesz - 1, NULL);
+
+	for (i = 0; i < pl.filesz; i++) {
+		if (SIZE_MAX == pl.fail && pl.files[i].html) {
+			free(hp->lang);
+			hp->lang = pl.files[i].lang;
+			hp->html = 1;
+		} else
+			free(pl.files[i].lang);
+	}
+
+	for (i = 0; i < jobs; i++)
+		hparse_free(hps[i]);
+
+	pthread_mutex_destroy(&pl.mutex);
+	free(pl.files);
+	free(tids);
+	free(hps);
+	free(pms);
+	return SIZE_MAX == pl.fail;
 }
 
 /*
- * Extract all translatable strings from argv and create an XLIFF file
- * template from the results.
+ * Extract all translatable strings from argv and the directories of
+ * -R and create an XLIFF file template from the results.
  */
 int
-extract(XML_Parser p, int copy, int argc, char *argv[])
+extract(XML_Parser p, const struct opts *o, int argc, char *argv[])
 {
 	struct hparse	*hp;
+	struct inputs	*in;
+	size_t		 jobs;
 	int		 rc;
 
-	hp = hparse_alloc(p, POP_EXTRACT);
+	hp = hparse_alloc(p, POP_EXTRACT, o);
+	in = inputs_alloc(o, argc, argv);
 
-	if (0 != (rc = scanner(hp, argc, argv)))
-		results_extract(hp, copy);
+	if ((jobs = inputs_jobs(in, o->jobs)) > 1)
+		rc = pextract(hp, jobs, in);
+	else
+		rc = scanner(hp, in);
+	if (NULL != in && ! inputs_finish(in))
+		rc = 0;
+
+	if (rc) {
+		words_finish(hp);
+		results_extract(hp, o->copy);
+	}
 
 	hparse_free(hp);
+	inputs_free(in);
 	return(rc);
 }
 
 /*
- * Translate the files in argv with the dictionary in xliff, echoing the
- * translated versions.
+ * Stop loading "xp" lazily: its targets can't be parsed on their own.
+ */
+static void
+xlazy_cancel(struct xparse *xp)
+{
+
+	if (NULL == xp->lazy)
+		return;
+	pthread_mutex_destroy(&xp->lazy->mutex);
+	free(xp->lazy);
+	xp->lazy = NULL;
+}
+
+/*
+ * Target content is parsed as UTF-8, so other encodings can't be
+ * loaded lazily.
+ */
+static void
+xdecl(void *dat, const XML_Char *version,
+	const XML_Char *encoding, int standalone)
+{
+	struct xparse	*p = dat;
+
+	if (NULL != encoding &&
+	    strcasecmp(encoding, "UTF-8") &&
+	    strcasecmp(encoding, "US-ASCII"))
+		xlazy_cancel(p);
+}
+
+/*
+ * Nor can targets that might use entities declared in the document.
+ */
+static void
+xdoctype(void *dat, const XML_Char *name, const XML_Char *sysid,
+	const XML_Char *pubid, int has_internal_subset)
+{
+	struct xparse	*p = dat;
+
+	if (has_internal_subset)
+		xlazy_cancel(p);
+}
+
+/*
+ * Parse and flatten the target of "x", which was skipped over when
+ * lazily loading "xp", into its own table.
+ * If the target doesn't parse, it's left empty.
+ * Must be called with the lazy state locked.
+ * The table is published last, so that xliff_target() may then use
+ * the target without locking.
+ */
+static void
+xlazy_parse(const struct xparse *xp, struct xliff *x)
+{
+	struct xlazy	*lz = xp->lazy;
+	struct xparse	*tp;
+	struct ftable	*tab;
+	int		 rc;
+
+	assert(NULL == x->tab);
+
+	if (NULL == lz->p && NULL == (lz->p = XML_ParserCreate(NULL)))
+		errx(EXIT_FAILURE, "XML_ParserCreate");
+
+	/* Wrap the content in its <target> to parse as usual. */
+
+	tp = xparse_alloc(xp->fname, lz->p);
+	tp->base = lz->map;
+	tp->baseoff = x->off;
+	XML_ParserReset(tp->p, NULL);
+	XML_SetDefaultHandlerExpand(tp->p, NULL);
+	XML_SetElementHandler(tp->p, xstart, xend);
+	XML_SetUserData(tp->p, tp);
+
+	rc = XML_STATUS_OK == XML_Parse(tp->p, "<target>", 8, 0) &&
+	     XML_STATUS_OK == XML_Parse(tp->p, 
+		lz->map + x->off, x->offsz, 0) &&
+	     XML_STATUS_OK == XML_Parse(tp->p, "</target>", 9, 1);
+	if ( ! rc)
+		xerr(tp, "%s",
+			XML_ErrorString(XML_GetErrorCode(tp->p)));
+
+	if (NULL == (tab = calloc(1, sizeof(struct ftable))))
+		err(EXIT_FAILURE, NULL);
+
+	if (rc) {
+		*tab = tp->tab;
+		memset(&tp->tab, 0, sizeof(struct ftable));
+		x->node = tp->target.node;
+		x->nodesz = tp->target.nodesz;
+	}
+
+	xparse_free(tp);
+	__atomic_store_n(&x->tab, tab, __ATOMIC_RELEASE);
+}
+
+/*
+ * Fill in "t" with the target of the "unit"th translation unit of
+ * "xp", parsing it first if loaded lazily.
+ * Returns zero if the target is empty.
  */
 int
-join(const char *xliff, XML_Parser p, 
-	int copy, int argc, char *argv[])
+xliff_target(const struct xparse *xp, size_t unit, struct ftarget *t)
+{
+	struct xliff		*x = &xp->xliffs[unit];
+	const struct ftable	*tab = &xp->tab;
+
+	/* Only lock to parse the target on first use. */
+
+	if (NULL != xp->lazy &&
+	    NULL == (tab = __atomic_load_n(&x->tab, __ATOMIC_ACQUIRE))) {
+		pthread_mutex_lock(&xp->lazy->mutex);
+		if (NULL == x->tab)
+			xlazy_parse(xp, x);
+		pthread_mutex_unlock(&xp->lazy->mutex);
+		tab = x->tab;
+	}
+
+	if (0 == x->nodesz)
+		return 0;
+
+	t->nodes = tab->nodes + x->node;
+	t->nodesz = x->nodesz;
+	t->atts = tab->atts;
+	t->strs = tab->strs;
+	return 1;
+}
+
+/*
+ * Parse the XLIFF file "xliff" into a new catalog.
+ * If "lazy" is set, targets aren't parsed until they're looked up
+ * (see xliff_target()) and a copy of the file is kept until then: this
+ * leaves only the sources to be parsed up front.
+ * Returns NULL on failure (after reporting the error).
+ */
+static struct xparse *
+xliff_load(const char *xliff, XML_Parser p, int lazy)
 {
 	struct xparse	*xp;
-	struct hparse	*hp;
 	char		*map;
 	size_t		 mapsz;
-	int		 fd, rc, c = 0;
+	int		 fd, rc, er;
 
-	if (-1 == (fd = map_open(xliff, &mapsz, &map)))
-		return 0;
+	if (lazy) {
+		fd = -1;
+		if (NULL == (map = file_read(xliff, &mapsz)))
+			return NULL;
+	} else if (-1 == (fd = map_open(xliff, &mapsz, &map)))
+		return NULL;
 
 	xp = xparse_alloc(xliff, p);
 
@@ -990,59 +2594,230 @@ join(const char *xliff, XML_Parser p,
 	XML_SetDefaultHandlerExpand(p, NULL);
 	XML_SetElementHandler(p, xstart, xend);
 	XML_SetUserData(p, xp);
-	rc = XML_Parse(p, map, mapsz, 1);
-	map_close(fd, map, mapsz);
 
-	if (XML_STATUS_OK == rc) {
-		hp = hparse_alloc(p, POP_JOIN);
-		hp->xp = xp;
-		hp->copy = copy;
-		c = scanner(hp, argc, argv);
-		assert(NULL == hp->words);
-		hparse_free(hp);
-	} else
+	/* Byte-order marks are the only hint of UTF-16. */
+
+	if (lazy && ! (mapsz >= 2 &&
+	    ((0xfe == (unsigned char)map[0] &&
+	      0xff == (unsigned char)map[1]) ||
+	     (0xff == (unsigned char)map[0] &&
+	      0xfe == (unsigned char)map[1])))) {
+		if (NULL == (xp->lazy = calloc(1, sizeof(struct xlazy))))
+			err(EXIT_FAILURE, NULL);
+		if (0 != (er = pthread_mutex_init(&xp->lazy->mutex, NULL)))
+			errc(EXIT_FAILURE, er, "pthread_mutex_init");
+		XML_SetXmlDeclHandler(p, xdecl);
+		XML_SetStartDoctypeDeclHandler(p, xdoctype);
+	}
+
+	rc = map_parse(p, map, mapsz);
+
+	XML_SetXmlDeclHandler(p, NULL);
+	XML_SetStartDoctypeDeclHandler(p, NULL);
+
+	if (NULL != xp->lazy) {
+		xp->lazy->map = map;
+		xp->lazy->mapsz = mapsz;
+	} else if (-1 == fd)
+		free(map);
+	else
+		map_close(fd, map, mapsz);
+
+	if (XML_STATUS_OK != rc) {
 		perr(xliff, p);
+		xparse_free(xp);
+		return NULL;
+	}
+
+	return xp;
+}
+
+/*
+ * Load the dictionary in "cat", indexing it if it's not compiled.
+ * If "keep" is set, the dictionary may outlive its file's contents
+ * (see serve()), so nothing is left mapped.
+ * Returns NULL on failure (after reporting the error).
+ */
+struct xparse *
+catalog_load(const struct catname *cat, XML_Parser p, int keep)
+{
+	struct xparse	*xp;
+
+	if (cat->compiled) {
+		xp = xparse_alloc(cat->fname, p);
+		if ( ! catalog_open(xp, cat->fname, keep)) {
+			xparse_free(xp);
+			return NULL;
+		}
+	} else if (NULL != (xp = xliff_load(cat->fname, p, 1)))
+		xliff_index(xp);
+
+	return xp;
+}
+
+/*
+ * Translate the files in argv and the directories of -R with the
+ * dictionaries in "cats", echoing the translated versions.
+ * Each file is parsed once and translated with all dictionaries; with
+ * more than one, each translation goes into its own file in the output
+ * directory.
+ * If there's more than one file (or -R) and more than one job,
+ * translate files in parallel.
+ */
+int
+join(const struct catname *cats, size_t catsz, XML_Parser p, 
+	const struct opts *o, int argc, char *argv[])
+{
+	struct xparse	**xps;
+	struct hparse	 *hp;
+	struct inputs	 *in;
+	size_t		  i, j, jobs;
+	int		  c = 0;
+
+	assert(catsz > 0);
+	assert(1 == catsz || NULL != o->outdir);
+
+	if (NULL == (xps = calloc(catsz, sizeof(struct xparse *))))
+		err(EXIT_FAILURE, NULL);
 
+	for (i = 0; i < catsz; i++)
+		if (NULL == (xps[i] = catalog_load(&cats[i], p, 0)))
+			goto out;
+
+	/* Outputs would clobber each other. */
+
+	for (i = 0; i < catsz; i++)
+		for (j = i + 1; j < catsz; j++)
+			if (NULL != xps[i]->trglang &&
+			    NULL != xps[j]->trglang &&
+			    0 == strcmp(xps[i]->trglang, 
+			     xps[j]->trglang)) {
+				fprintf(stderr, "%s: same target "
+					"language as %s\n",
+					xps[j]->fname, xps[i]->fname);
+				goto out;
+			}
+
+	hp = hparse_alloc(p, POP_JOIN, o);
+	hp->outsz = catsz;
+	hp->outs = calloc(catsz, sizeof(struct hout));
+	if (NULL == hp->outs)
+		err(EXIT_FAILURE, NULL);
+	for (i = 0; i < catsz; i++) {
+		hp->outs[i].xp = xps[i];
+		sink_init(&hp->outs[i].out, 
+			NULL == o->outdir ? STDOUT_FILENO : -1);
+	}
+
+	in = inputs_alloc(o, argc, argv);
+	if ((jobs = inputs_jobs(in, o->jobs)) > 1)
+		c = pjoin(hp, jobs, in);
+	else
+		c = scanner(hp, in);
+	if (NULL != in && ! inputs_finish(in))
+		c = 0;
+	assert(0 == hp->words.sz);
+
+	if (NULL == o->outdir && ! sink_flush(&hp->outs[0].out)) {
+		warn("<stdout>");
+		c = 0;
+	}
+
+	if (o->verbose)
+		for (i = 0; i < catsz; i++)
+			xliff_stats(&hp->outs[i]);
+
+	hparse_free(hp);
+	inputs_free(in);
+out:
+	for (i = 0; i < catsz && NULL != xps[i]; i++)
+		xparse_free(xps[i]);
+	free(xps);
+	return c;
+}
+
+/*
+ * Translate the document "doc" (named "fname" in errors) with the
+ * dictionary "xp", appending the translation to "out".
+ * This is how the server translates requests.
+ */
+int
+join_doc(XML_Parser p, const struct opts *o, const struct xparse *xp,
+	const char *fname, const char *doc, size_t docsz, struct sink *out)
+{
+	struct hparse	*hp;
+	int		 rc;
+
+	assert(NULL != doc);
+
+	hp = hparse_alloc(p, POP_JOIN, o);
+	hp->outsz = 1;
+	if (NULL == (hp->outs = calloc(1, sizeof(struct hout))))
+		err(EXIT_FAILURE, NULL);
+	hp->outs[0].xp = xp;
+	hp->outs[0].out = *out;
+	hp->fname = fname;
+
+	rc = dofile(hp, doc, docsz, 0);
+
+	*out = hp->outs[0].out;
+	sink_init(&hp->outs[0].out, -1);
+	hparse_free(hp);
+	return rc;
+}
+
+/*
+ * Compile the dictionary in xliff into the catalog "out".
+ */
+int
+compile(const char *xliff, XML_Parser p, const char *out)
+{
+	struct xparse	*xp;
+	int		 c;
+
+	if (NULL == (xp = xliff_load(xliff, p, 0)))
+		return 0;
+
+	xliff_index(xp);
+	c = catalog_write(xp, out);
 	xparse_free(xp);
 	return c;
 }
 
 /*
  * Update (not in-line) the dictionary file xliff with the contents of
- * argv, outputting the merged XLIFF file.
+ * argv and the directories of -R, outputting the merged XLIFF file.
  */
 int
-update(const char *xliff, XML_Parser p, int copy, 
-	int keep, int quiet, int argc, char *argv[])
+update(const char *xliff, XML_Parser p, 
+	const struct opts *o, int argc, char *argv[])
 {
 	struct xparse	*xp;
 	struct hparse	*hp;
-	char		*map;
-	size_t		 mapsz;
-	int		 fd, rc;
+	struct inputs	*in;
+	size_t		 jobs;
+	int		 rc;
 
-	if (-1 == (fd = map_open(xliff, &mapsz, &map)))
+	if (NULL == (xp = xliff_load(xliff, p, 0)))
 		return 0;
 
-	xp = xparse_alloc(xliff, p);
+	hp = hparse_alloc(p, POP_EXTRACT, o);
+	hp->xp = xp;
+	in = inputs_alloc(o, argc, argv);
 
-	XML_ParserReset(p, NULL);
-	XML_SetDefaultHandlerExpand(p, NULL);
-	XML_SetElementHandler(p, xstart, xend);
-	XML_SetUserData(p, xp);
-	rc = XML_Parse(p, map, mapsz, 1);
-
-	map_close(fd, map, mapsz);
-
-	if (XML_STATUS_OK == rc) {
-		hp = hparse_alloc(p, POP_EXTRACT);
-		hp->xp = xp;
-		if (0 != (rc = scanner(hp, argc, argv)))
-			results_update(hp, copy, keep, quiet);
-		hparse_free(hp);
-	} else
-		perr(xliff, p);
+	if ((jobs = inputs_jobs(in, o->jobs)) > 1)
+		rc = pextract(hp, jobs, in);
+	else
+		rc = scanner(hp, in);
+	if (NULL != in && ! inputs_finish(in))
+		rc = 0;
 
+	if (rc) {
+		words_finish(hp);
+		results_update(hp, o->copy, o->keep, o->quiet);
+	}
+	hparse_free(hp);
+	inputs_free(in);
 	xparse_free(xp);
-	return XML_STATUS_OK == rc;
+	return rc;
 }
@@ -29,15 +29,263 @@
 
 #include "extern.h"
 
+/*
+ * A block of arena memory, followed by its data.
+ * This is a multiple of 16 bytes, so data is aligned as with malloc.
+ */
+struct	arenablk {
+	struct arenablk	*next; /* next block */
+	size_t		 sz; /* size of data */
+	size_t		 used; /* bytes in use */
+	size_t		 last; /* offset of last allocation */
+};
+
+#define	ARENA_BLKSZ	(16 * 1024 - sizeof(struct arenablk))
+#define	ARENA_ALIGN(_sz) (((_sz) + 15) & ~(size_t)15)
+
+/*
+ * Allocate "sz" zeroed bytes from the arena.
+ * Blocks left over from a prior reset are reused before new ones are
+ * allocated.
+ * Large allocations get a block with as much room again, so that
+ * growing them with arena_realloc() is amortised.
+ */
+static void *
+arena_alloc(struct arena *a, size_t sz)
+{
+	struct arenablk	*b;
+	size_t		 bsz;
+	char		*p;
+
+	if (sz > (SIZE_MAX - sizeof(struct arenablk)) / 2)
+		errx(EXIT_FAILURE, "arena allocation too large");
+	sz = ARENA_ALIGN(sz);
+
+	while (NULL != a->cur && a->cur->used + sz > a->cur->sz) {
+		if (NULL == a->cur->next)
+			break;
+		a->cur = a->cur->next;
+		a->cur->used = 0;
+	}
+
+	if (NULL == a->cur || a->cur->used + sz > a->cur->sz) {
+		bsz = sz > ARENA_BLKSZ / 2 ? sz * 2 : ARENA_BLKSZ;
+		if (NULL == (b = malloc(sizeof(struct arenablk) + bsz)))
+			err(EXIT_FAILURE, NULL);
+		b->next = NULL;
+		b->sz = bsz;
+		b->used = 0;
+		if (NULL == a->cur)
+			a->first = b;
+		else
+			a->cur->next = b;
+		a->cur = b;
+	}
+
+	p = (char *)(a->cur + 1) + a->cur->used;
+	a->cur->last = a->cur->used;
+	a->cur->used += sz;
+	memset(p, 0, sz);
+	return p;
+}
+
+/*
+ * Grow "p", of size "osz", to "nsz" bytes.
+ * If it's the last allocation and there's room, this grows in place.
+ * Otherwise, the old memory is simply left in the arena.
+ */
+static void *
+arena_realloc(struct arena *a, void *p, size_t osz, size_t nsz)
+{
+	char	*np, *data;
+
+	assert(nsz >= osz);
+
+	if (NULL != p && NULL != a->cur) {
+		data = (char *)(a->cur + 1);
+		if ((char *)p == data + a->cur->last &&
+		    nsz <= a->cur->sz - a->cur->last) {
+			a->cur->used = a->cur->last + ARENA_ALIGN(nsz);
+			return p;
+		}
+	}
+
+	np = arena_alloc(a, nsz);
+	if (NULL != p)
+		memcpy(np, p, osz);
+	return np;
+}
+
+static char *
+arena_strndup(struct arena *a, const char *s, size_t len)
+{
+	char	*p;
+
+	p = arena_alloc(a, len + 1);
+	memcpy(p, s, len);
+	return p;
+}
+
+/*
+ * A name being looked up in a table of names.
+ */
+struct	namekey {
+	const struct names *n;
+	const char	   *s;
+};
+
+static int
+names_eq(const void *arg, size_t i)
+{
+	const struct namekey *k = arg;
+
+	return 0 == strcmp(k->n->tab[i], k->s);
+}
+
+static uint64_t
+names_hash(const void *arg, size_t i)
+{
+	const struct names *n = arg;
+
+	return key_hash(0, n->tab[i], strlen(n->tab[i]));
+}
+
+/*
+ * Look up "s" in the table of names, adding it if not found.
+ */
+static char *
+names_add(struct names *n, const char *s)
+{
+	struct namekey	 k;
+	size_t		 j, len;
+
+	len = strlen(s);
+	k.n = n;
+	k.s = s;
+
+	slots_reserve(&n->idx, n->count + 1, 6, names_hash, n);
+	j = slots_find(n->idx.slot, n->idx.bits,
+		key_hash(0, s, len), names_eq, &k, NULL);
+	assert(SIZE_MAX != j);
+	if (0 != n->idx.slot[j])
+		return n->tab[n->idx.slot[j] - 1];
+
+	if (n->count == n->max) {
+		n->max = 0 == n->max ? 64 : n->max * 2;
+		n->tab = reallocarray(n->tab, n->max, sizeof(char *));
+		if (NULL == n->tab)
+			err(EXIT_FAILURE, NULL);
+	}
+
+	n->tab[n->count] = arena_strndup(&n->arena, s, len);
+	n->idx.slot[j] = ++n->count;
+	return n->tab[n->count - 1];
+}
+
+/*
+ * Intern the element name "s" in lowercase, as HTML5 names are case
+ * insensitive.
+ * The result lasts as long as "q" itself, not just its current
+ * sequence, and names equal but for case always have the same pointer.
+ */
+const char *
+frag_intern(struct fragseq *q, const char *s)
+{
+	char		 buf[64], *cp;
+	const char	*name;
+	size_t		 i, len;
+
+	len = strlen(s);
+	if (len < sizeof(buf))
+		cp = buf;
+	else if (NULL == (cp = malloc(len + 1)))
+		err(EXIT_FAILURE, NULL);
+
+	for (i = 0; i < len; i++)
+		cp[i] = tolower((unsigned char)s[i]);
+	cp[len] = '\0';
+
+	name = names_add(&q->names, cp);
+	if (buf != cp)
+		free(cp);
+	return name;
+}
+
+/*
+ * Release all allocations at once, keeping blocks for reuse.
+ */
+static void
+arena_reset(struct arena *a)
+{
+
+	if (NULL != (a->cur = a->first))
+		a->cur->used = 0;
+}
+
+static void
+arena_free(struct arena *a)
+{
+	struct arenablk	*b;
+
+	while (NULL != (b = a->first)) {
+		a->first = b->next;
+		free(b);
+	}
+	a->cur = NULL;
+}
+
+/*
+ * Make room for "len" more bytes (and a terminator) in "b".
+ */
+static void
+buf_reserve(struct buf *b, size_t len)
+{
+	size_t	 max;
+
+	if (len > SIZE_MAX - b->sz - 1)
+		errx(EXIT_FAILURE, "buffer too large");
+
+	if (b->sz + len + 1 > b->max) {
+		max = 0 == b->max ? 64 : b->max;
+		while (max < b->sz + len + 1)
+			max = max > SIZE_MAX / 2 ? 
+				b->sz + len + 1 : max * 2;
+		if (NULL == (b->b = realloc(b->b, max)))
+			err(EXIT_FAILURE, NULL);
+		b->max = max;
+	}
+}
+
+/*
+ * Append "len" bytes of "s" to "b", growing it geometrically.
+ */
+void
+buf_append(struct buf *b, const char *s, size_t len)
+{
+
+	if (0 == len)
+		return;
+
+	buf_reserve(b, len);
+	memcpy(b->b + b->sz, s, len);
+	b->sz += len;
+	b->b[b->sz] = '\0';
+}
+
+void
+buf_free(struct buf *b)
+{
+
+	free(b->b);
+	b->b = NULL;
+	b->sz = b->max = 0;
+}
+
 static void
 frag_append_text(struct fragseq *q, const XML_Char *s, size_t len)
 {
 
-	q->copy = realloc(q->copy, q->copysz + len);
-	if (NULL == q->copy)
-		err(EXIT_FAILURE, NULL);
-	memcpy(q->copy + q->copysz, s, len);
-	q->copysz += len;
+	buf_append(&q->copy, s, len);
 }
 
 static void
@@ -71,28 +319,150 @@ frag_copy_elem(struct fragseq *q, int null,
 	frag_append_text(q, ">", 1);
 }
 
+/*
+ * Allocate the root node, if not already allocated.
+ */
 static void
-frag_node_free(struct frag *f)
+frag_root(struct fragseq *q)
 {
-	size_t	  i;
-	char	**atts;
 
-	if (NULL == f)
+	if (NULL != q->root)
 		return;
 
-	for (i = 0; i < f->childsz; i++)
-		frag_node_free(f->child[i]);
+	assert(NULL == q->cur);
+	q->root = arena_alloc(&q->arena, sizeof(struct frag));
+	q->root->type = FRAG_ROOT;
+	q->cur = q->root;
+}
 
-	if (NULL != f->atts)
-		for (atts = f->atts; NULL != *atts; atts += 2) {
-			free(atts[0]);
-			free(atts[1]);
-		}
+/*
+ * Append "f" to the children of the current node.
+ */
+static void
+frag_child_add(struct fragseq *q, struct frag *f)
+{
+	struct frag	*p = q->cur;
+	size_t		 max;
+
+	if (p->childsz == p->childmax) {
+		max = 0 == p->childmax ? 4 : p->childmax * 2;
+		p->child = arena_realloc(&q->arena, p->child,
+			p->childmax * sizeof(struct frag *),
+			max * sizeof(struct frag *));
+		p->childmax = max;
+	}
+
+	p->child[p->childsz] = f;
+	if (p->childsz)
+		p->child[p->childsz - 1]->next = f;
+	p->childsz++;
+
+	/* Text starts out as white-space (see frag_node_text()). */
+
+	if (FRAG_NODE == f->type)
+		p->nodesz++;
+	else if (FRAG_TEXT == f->type && 0 == f->has_nonws)
+		p->wssz++;
+}
+
+/*
+ * If the children of "f" are a single element, possibly surrounded by
+ * white-space, return the element; otherwise, NULL.
+ * Adjacent text is merged, so the element is one of the first two.
+ */
+static const struct frag *
+frag_wrapper(const struct frag *f)
+{
+
+	if (1 != f->nodesz || f->childsz != 1 + f->wssz)
+		return NULL;
+	return FRAG_NODE == f->child[0]->type ? 
+		f->child[0] : f->child[1];
+}
+
+/*
+ * Where a serialised key goes: appended to a buffer, compared with an
+ * existing key, or hashed.
+ */
+struct	keyout {
+	struct buf	*buf; /* if serialising, output */
+	const char	*cmp; /* if comparing, expected key */
+	size_t		 cmpsz; /* if comparing, its length */
+	int		 neq; /* if comparing, whether unequal */
+	uint64_t	 hash; /* if hashing, running hash */
+	size_t		 sz; /* bytes compared or hashed */
+};
+
+static void
+keyout_write(struct keyout *ko, const char *s, size_t len)
+{
+
+	if (NULL != ko->buf) {
+		buf_append(ko->buf, s, len);
+		return;
+	} else if (NULL == ko->cmp) {
+		ko->hash = key_hash(ko->hash, s, len);
+		ko->sz += len;
+		return;
+	} else if (ko->neq)
+		return;
+
+	/* Ignore any bytes past the key. */
+
+	if (len > ko->cmpsz - ko->sz)
+		len = ko->cmpsz - ko->sz;
+	if (len > 0 && memcmp(ko->cmp + ko->sz, s, len))
+		ko->neq = 1;
+	ko->sz += len;
+}
+
+/*
+ * Serialise the opening of element "f".
+ */
+static void
+frag_key_open(const struct frag *f, struct keyout *ko)
+{
+	char		 nbuf[32];
+	char * const	*attp;
+	size_t		 id, i;
+
+	/* This is run for every element, so avoid snprintf(3). */
+
+	i = sizeof(nbuf);
+	id = f->id;
+	do
+		nbuf[--i] = '0' + id % 10;
+	while ((id /= 10) > 0);
+
+	keyout_write(ko, f->is_null ? "<x id=\"" : "<g id=\"", 7);
+	keyout_write(ko, nbuf + i, sizeof(nbuf) - i);
+	keyout_write(ko, "\"", 1);
+	for (attp = f->atts; NULL != *attp; attp += 2) { 
+		keyout_write(ko, " xhtml:", 7);
+		keyout_write(ko, attp[0], strlen(attp[0]));
+		keyout_write(ko, "=\"", 2);
+		keyout_write(ko, attp[1], strlen(attp[1]));
+		keyout_write(ko, "\"", 1);
+	}
+	if (f->is_null)
+		keyout_write(ko, "/>", 2);
+	else
+		keyout_write(ko, ">", 1);
+}
+
+/*
+ * If keying "q", append the text of "f" from "from" onward to the hash
+ * of the serialised tree.
+ */
+static void
+frag_key_text(struct fragseq *q, struct frag *f, size_t from)
+{
 
-	free(f->atts);
-	free(f->child);
-	free(f->val);
-	free(f);
+	if ( ! q->keyed)
+		return;
+	q->khash = f->hend = 
+		key_hash(q->khash, f->val + from, f->valsz - from);
+	q->ksz = f->kend = q->ksz + (f->valsz - from);
 }
 
 /*
@@ -107,17 +477,10 @@ frag_node_start(struct fragseq *q,
 	struct frag	 *f;
 	size_t		  i = 0;
 	const XML_Char	**attp;
+	struct keyout	  ko;
 
 	frag_copy_elem(q, null, s, atts);
-
-	if (NULL == q->root) {
-		assert(NULL == q->cur);
-		q->root = calloc(1, sizeof(struct frag));
-		if (NULL == q->root)
-			err(EXIT_FAILURE, NULL);
-		q->root->type = FRAG_ROOT;
-		q->cur = q->root;
-	}
+	frag_root(q);
 
 	assert(NULL != q->cur);
 	assert(NULL != q->root);
@@ -125,43 +488,44 @@ frag_node_start(struct fragseq *q,
 	for (attp = atts; NULL != *attp; attp += 2, i += 2) 
 		continue;
 
-	f = calloc(1, sizeof(struct frag));
-	if (NULL == f)
-		err(EXIT_FAILURE, NULL);
-
+	f = arena_alloc(&q->arena, sizeof(struct frag));
 	f->is_null = null;
 	f->type = FRAG_NODE;
-	f->val = strdup(s);
-	f->valsz = strlen(f->val);
+	f->val = names_add(&q->names, s);
+	f->valsz = strlen(s);
+	f->name = frag_intern(q, s);
 	f->parent = q->cur;
-	f->atts = calloc(i + 1, sizeof(char *));
+	f->atts = arena_alloc(&q->arena, (i + 1) * sizeof(char *));
 	f->id = q->elemsz;
-	if (NULL == f->atts)
-		err(EXIT_FAILURE, NULL);
 	for (i = 0, attp = atts; NULL != *attp; attp += 2, i += 2) {
-		f->atts[i] = strdup(attp[0]);
-		f->atts[i + 1] = strdup(attp[1]);
+		f->atts[i] = names_add(&q->names, attp[0]);
+		f->atts[i + 1] = arena_strndup
+			(&q->arena, attp[1], strlen(attp[1]));
  	}
 
-	q->cur->child = reallocarray
-		(q->cur->child, q->cur->childsz + 1,
-		 sizeof(struct frag *));
-	if (NULL == q->cur->child)
-		err(EXIT_FAILURE, NULL);
-	q->cur->child[q->cur->childsz] = f;
-	if (q->cur->childsz)
-		q->cur->child[q->cur->childsz - 1]->next = f;
-	q->cur->childsz++;
+	/* The key hash is built as the tree is, in key order. */
+
+	if (q->keyed) {
+		memset(&ko, 0, sizeof(struct keyout));
+		ko.hash = f->hbeg = q->khash;
+		ko.sz = f->kbeg = q->ksz;
+		frag_key_open(f, &ko);
+		q->khash = f->hend = ko.hash;
+		q->ksz = f->kend = ko.sz;
+	}
+
+	frag_child_add(q, f);
 	q->cur = f;
 
-	/* Add to list of all elements. */
+	/* Add to list of all elements, which is kept across clears. */
 
-	q->elems = reallocarray
-		(q->elems,
-		 q->elemsz + 1,
-		 sizeof(struct frag *));
-	if (NULL == q->elems)
-		err(EXIT_FAILURE, NULL);
+	if (q->elemsz == q->elemmax) {
+		q->elemmax = 0 == q->elemmax ? 16 : q->elemmax * 2;
+		q->elems = reallocarray(q->elems,
+			q->elemmax, sizeof(struct frag *));
+		if (NULL == q->elems)
+			err(EXIT_FAILURE, NULL);
+	}
 	q->elems[q->elemsz++] = f;
 }
 
@@ -175,20 +539,10 @@ frag_node_text(struct fragseq *q,
 	const XML_Char *s, size_t len, int preserve)
 {
 	struct frag	*f;
-	size_t		 i;
+	size_t		 i, from;
 
 	frag_append_text(q, s, len);
-
-	/* Allocate root, if not existing. */
-
-	if (NULL == q->root) {
-		assert(NULL == q->cur);
-		q->root = calloc(1, sizeof(struct frag));
-		if (NULL == q->root)
-			err(EXIT_FAILURE, NULL);
-		q->root->type = FRAG_ROOT;
-		q->cur = q->root;
-	}
+	frag_root(q);
 
 	assert(NULL != q->root);
 	assert(NULL != q->cur);
@@ -199,20 +553,12 @@ frag_node_text(struct fragseq *q,
 	/* Allocate text node, if applicable. */
 
 	if (NULL == f || FRAG_TEXT != f->type) {
-		f = calloc(1, sizeof(struct frag));
-		if (NULL == f)
-			err(EXIT_FAILURE, NULL);
+		f = arena_alloc(&q->arena, sizeof(struct frag));
 		f->type = FRAG_TEXT;
 		f->parent = q->cur;
-		q->cur->child = reallocarray
-			(q->cur->child, q->cur->childsz + 1,
-			 sizeof(struct frag *));
-		if (NULL == q->cur->child)
-			err(EXIT_FAILURE, NULL);
-		q->cur->child[q->cur->childsz] = f;
-		if (q->cur->childsz)
-			q->cur->child[q->cur->childsz - 1]->next = f;
-		q->cur->childsz++;
+		f->hbeg = f->hend = q->khash;
+		f->kbeg = f->kend = q->ksz;
+		frag_child_add(q, f);
 	}
 
 	/* See if we have any non-spaces. */
@@ -221,6 +567,7 @@ frag_node_text(struct fragseq *q,
 		for (i = 0; i < len; i++)
 			if ( ! isspace((unsigned char)s[i])) {
 				f->has_nonws = 1;
+				f->parent->wssz--;
 				break;
 			}
 
@@ -230,18 +577,19 @@ frag_node_text(struct fragseq *q,
 	 * convert newlines to spaces.
 	 */
 
+	/* Usually the last allocation, so this grows in place. */
+
+	f->val = arena_realloc(&q->arena, 
+		f->val, f->valsz, f->valsz + len);
+	from = f->valsz;
+
 	if (preserve) {
-		f->val = realloc(f->val, f->valsz + len);
-		if (NULL == f->val)
-			err(EXIT_FAILURE, NULL);
 		memcpy(f->val + f->valsz, s, len);
 		f->valsz += len;
+		frag_key_text(q, f, from);
 		return;
 	} 
 
-	f->val = realloc(f->val, f->valsz + len);
-	if (NULL == f->val)
-		err(EXIT_FAILURE, NULL);
 	for (i = 0; i < len; ) {
 		if (f->valsz &&
 		    isspace((unsigned char)s[i]) &&
@@ -253,95 +601,53 @@ frag_node_text(struct fragseq *q,
 		if (isspace((unsigned char)f->val[f->valsz - 1]))
 			f->val[f->valsz - 1] = ' ';
 	}
+
+	frag_key_text(q, f, from);
 }
 
 void
-frag_node_end(struct fragseq *q, const XML_Char *s)
+frag_node_end(struct fragseq *q, const char *name)
 {
 
 	assert(NULL != q->cur);
 	assert(FRAG_NODE == q->cur->type);
-	assert(0 == strcmp(s, q->cur->val));
+	assert(name == q->cur->name);
 
-	frag_copy_elem(q, q->cur->is_null, s, NULL);
+	frag_copy_elem(q, q->cur->is_null, q->cur->val, NULL);
 	q->cur->node_closed = 1;
-	q->cur = q->cur->parent;
-}
 
-static void
-frag_append(char **buf, size_t *sz, 
-	size_t *max, const XML_Char *s, size_t len)
-{
-
-	if (NULL == s || 0 == len)
-		return;
-
-	if (*sz + len + 1 > *max) {
-		*max = *sz + len + 1;
-		if (NULL == (*buf = realloc(*buf, *max)))
-			err(EXIT_FAILURE, NULL);
+	if (q->keyed) {
+		if ( ! q->cur->is_null) {
+			q->khash = key_hash(q->khash, "</g>", 4);
+			q->ksz += 4;
+		}
+		q->cur->hend = q->khash;
+		q->cur->kend = q->ksz;
 	}
 
-	assert(NULL != *buf);
-	memcpy(*buf + *sz, s, len);
-	*sz += len;
-	(*buf)[*sz] = '\0';
+	q->cur = q->cur->parent;
 }
 
 /*
- * Recursively serialise "f" into the dynamic buffer.
+ * Recursively serialise "f" into "ko".
  */
 static void
-frag_serialise_r(const struct frag *f, 
-	char **buf, size_t *sz, size_t *max)
+frag_serialise_r(const struct frag *f, struct keyout *ko)
 {
-	size_t	 	  i, nbufsz;
-	char		  nbuf[32];
-	char * const	 *attp;
+	size_t	 i;
 
 	assert(NULL != f);
 
-	if (FRAG_NODE == f->type) {
-		frag_append(buf, sz, max, "<", 1);
-		snprintf(nbuf, sizeof(nbuf), "%zu", f->id);
-		nbufsz = strlen(nbuf);
-		if (f->is_null) {
-			frag_append(buf, sz, max, "x id=\"", 6);
-			frag_append(buf, sz, max, nbuf, nbufsz);
-			frag_append(buf, sz, max, "\"", 1);
-			for (attp = f->atts; NULL != *attp; attp += 2) { 
-				frag_append(buf, sz, max, " xhtml:", 7);
-				frag_append(buf, sz, max, 
-					attp[0], strlen(attp[0]));
-				frag_append(buf, sz, max, "=\"", 2);
-				frag_append(buf, sz, max, 
-					attp[1], strlen(attp[1]));
-				frag_append(buf, sz, max, "\"", 1);
-			}
-			frag_append(buf, sz, max, "/>", 2);
-		} else {
-			frag_append(buf, sz, max, "g id=\"", 6);
-			frag_append(buf, sz, max, nbuf, nbufsz);
-			frag_append(buf, sz, max, "\"", 1);
-			for (attp = f->atts; NULL != *attp; attp += 2) { 
-				frag_append(buf, sz, max, " xhtml:", 7);
-				frag_append(buf, sz, max, 
-					attp[0], strlen(attp[0]));
-				frag_append(buf, sz, max, "=\"", 2);
-				frag_append(buf, sz, max, 
-					attp[1], strlen(attp[1]));
-				frag_append(buf, sz, max, "\"", 1);
-			}
-			frag_append(buf, sz, max, ">", 1);
-		}
-	} else if (FRAG_TEXT == f->type)
-		frag_append(buf, sz, max, f->val, f->valsz);
+	if (FRAG_NODE == f->type)
+		frag_key_open(f, ko);
+	else if (FRAG_TEXT == f->type)
+		keyout_write(ko, f->val, f->valsz);
 
-	for (i = 0; i < f->childsz; i++)
-		frag_serialise_r(f->child[i], buf, sz, max);
+	for (i = 0; i < f->childsz && ! ko->neq; i++)
+		frag_serialise_r(f->child[i], ko);
 
 	if (FRAG_NODE == f->type && f->node_closed && ! f->is_null)
-		frag_append(buf, sz, max, "</g>", 4);
+		keyout_write(ko, "</g>", 4);
 }
 
 static int
@@ -353,231 +659,255 @@ frag_canreduce(const struct frag *f)
 }
 
 /*
- * If "minimise", then ignore empty nodes.
- * Empty nodes are things like <img />, optionally surrounded by space.
- * If "reduce" is non-NULL, then strip away surrounding material to get
- * to translatable content.
+ * Minimisation pass: return zero if we encounter standalone nodes,
+ * with or without surrounding whitespace.
+ * For example, " <b><img /></b> ".
+ */
+static int
+frag_minimise(const struct frag *f)
+{
+
+	for ( ; NULL != f; f = frag_wrapper(f))
+		if (0 == f->childsz || 
+		    (1 == f->childsz && 1 == f->wssz))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Reduction: top-down, strip away superfluous elements in our fragment
+ * tree "f", setting the range of children in "k" that remain and the
+ * white-space to trim from either end of it.
+ * This is limited to surrounding empty elements, possibly buffered
+ * with white-space.
+ * For example, " <b>foo</b> " -> "foo".
+ * For example, " <b><i>foo</i> <i>bar</i></b> " -> "<i>foo</i>
+ * <i>bar</i>".
  * If any stripping occurs, set "reduce" to be non-zero.
+ * Returns zero if nothing remains.
  */
-char *
-frag_serialise(const struct fragseq *q, int minimise, int *reduce)
+static int
+frag_reduce(const struct frag *f, struct fragkey *k, int *reduce)
 {
-	size_t	 i, sz = 0, max = 0, nt, nn, nsz;
-	char	*buf = NULL;
-	const struct frag *ff, *f;
+	size_t	 	   i, nsz;
+	const struct frag *ff, *next, *first, *last;
 
-	if (NULL == q || NULL == (f = q->root))
-		return NULL;
+	for (ff = f; NULL != (next = frag_wrapper(ff)); ff = next)
+		continue;
 
-	/*
-	 * Minimisation pass: return NULL if we encounter standalone
-	 * nodes, with or without surrounding whitespace.
-	 * For example, " <b><img /></b> ".
-	 * TODO: this should be a bottom-up accumulation of non-space
-	 * text content count.
-	 */
+	for (nsz = ff->childsz; nsz > 0; nsz--)
+		if ( ! frag_canreduce(ff->child[nsz - 1]))
+			break;
+	for (i = 0; i < nsz; i++)
+		if ( ! frag_canreduce(ff->child[i]))
+			break;
 
-	if (minimise)
-		for (ff = f; NULL != ff; ) {
-			if (0 == ff->childsz)
-				return NULL;
+	k->node = ff;
+	k->first = i;
+	k->last = nsz;
+	*reduce = f != ff;
 
-			/* Only whitespace? */
+	if (k->first == k->last)
+		return 0;
 
-			if (1 == ff->childsz &&
-			    FRAG_TEXT == ff->child[0]->type &&
-			    0 == ff->child[0]->has_nonws)
-				return NULL;
+	/* 
+	 * Trimmed white-space can only be in surrounding text, which
+	 * has non-white-space content or it would have been reduced.
+	 * Null elements have no content.
+	 */
 
-			/* Count number of text/nodes in children. */
+	first = ff->child[k->first];
+	last = ff->child[k->last - 1];
+	assert( ! (FRAG_NODE == last->type && 
+		last->is_null && last->childsz));
 
-			for (nn = nt = i = 0; i < ff->childsz; i++) {
-				nn += FRAG_NODE == ff->child[i]->type;
-				nt += FRAG_TEXT == ff->child[i]->type &&
-					0 == ff->child[i]->has_nonws;
-			}
+	if (FRAG_TEXT == first->type)
+		while (isspace((unsigned char)first->val[k->lead]))
+			k->lead++;
 
-			/* Stop if not one node and whitespace. */
+	if (FRAG_TEXT == last->type)
+		while (isspace((unsigned char)
+		       last->val[last->valsz - k->trail - 1]))
+			k->trail++;
 
-			if (1 != nn || nn + nt != ff->childsz) {
-				ff = NULL;
-				break;
-			}
+	return 1;
+}
 
-			/* Descend into node. */
+/*
+ * Serialise the reduced and trimmed key "k" into "ko".
+ */
+static void
+frag_key_write(const struct fragkey *k, struct keyout *ko)
+{
+	size_t		   i, beg, end;
+	const struct frag *f;
 
-			if (FRAG_NODE == ff->child[0]->type) 
-				ff = ff->child[0];
-			else if (FRAG_NODE == ff->child[1]->type) 
-				ff = ff->child[1];
-			else if (FRAG_NODE == ff->child[2]->type) 
-				ff = ff->child[2];
-			else
-				abort();
+	for (i = k->first; i < k->last && ! ko->neq; i++) {
+		f = k->node->child[i];
+		if (FRAG_TEXT != f->type) {
+			frag_serialise_r(f, ko);
+			continue;
 		}
+		beg = i == k->first ? k->lead : 0;
+		end = f->valsz - (i == k->last - 1 ? k->trail : 0);
+		keyout_write(ko, f->val + beg, end - beg);
+	}
+}
 
-	/*
-	 * Reduction: top-down, strip away superfluous elements in our
-	 * fragment tree.  
-	 * This is limited to surrounding empty elements, possibly
-	 * buffered with white-space.
-	 * For example, " <b>foo</b> " -> "foo".
-	 * For example, " <b><i>foo</i> <i>bar</i></b> " -> "<i>foo</i>
-	 * <i>bar</i>".
-	 */
+/*
+ * If "minimise", then ignore empty nodes.
+ * Empty nodes are things like <img />, optionally surrounded by space.
+ * If "reduce", then strip away surrounding material and white-space
+ * to get to translatable content (see frag_reduce()).
+ * The result is serialised into "buf", which is reset beforehand, and
+ * is returned (or NULL if there's nothing to translate).
+ */
+const char *
+frag_serialise(const struct fragseq *q, 
+	int minimise, int reduce, struct buf *buf)
+{
+	const struct frag *f;
+	struct fragkey	   k;
+	struct keyout	   ko;
 
-	if (NULL != reduce) {
-		for (ff = f; NULL != ff; ) {
-			assert(ff->childsz);
+	buf->sz = 0;
 
-			/* Only child is text: send to output. */
+	if (NULL == q || NULL == (f = q->root))
+		return NULL;
 
-			if (1 == ff->childsz &&
-			    FRAG_TEXT == ff->child[0]->type &&
-			    ff->child[0]->has_nonws) {
-				frag_serialise_r
-					(ff->child[0], 
-					 &buf, &sz, &max);
-				*reduce = f != ff;
-				break;
-			}
+	if (minimise && ! frag_minimise(f))
+		return NULL;
 
-			/*
-			 * If just a single node w/whitespace buffering,
-			 * recurse into the node.
-			 * Otherwise, trim surrounding white-space and
-			 * send remaining parts into the output.
-			 */
-
-			for (nn = nt = i = 0; i < ff->childsz; i++) {
-				nn += FRAG_NODE == ff->child[i]->type;
-				nt += FRAG_TEXT == ff->child[i]->type &&
-					0 == ff->child[i]->has_nonws;
-			}
+	memset(&ko, 0, sizeof(struct keyout));
+	ko.buf = buf;
 
-			if (1 == nn && nn + nt == ff->childsz) {
-				if (FRAG_NODE == ff->child[0]->type) 
-					ff = ff->child[0];
-				else if (FRAG_NODE == ff->child[1]->type) 
-					ff = ff->child[1];
-				else if (FRAG_NODE == ff->child[2]->type) 
-					ff = ff->child[2];
-				else
-					abort();
-				continue;
-			}
+	if ( ! reduce)
+		frag_serialise_r(f, &ko);
+	else if (frag_key(q, &k, NULL)) {
+		if (k.len)
+			buf_reserve(buf, k.len);
+		frag_key_write(&k, &ko);
+	}
 
-			nsz = ff->childsz;
-			assert(nsz);
-
-			for (nsz = ff->childsz; nsz > 0; nsz--)
-				if ( ! frag_canreduce(ff->child[nsz - 1]))
-					break;
-			for (i = 0; i < nsz; i++)
-				if ( ! frag_canreduce(ff->child[i]))
-					break;
-			for ( ; i < nsz; i++)
-				frag_serialise_r
-					(ff->child[i], 
-					 &buf, &sz, &max);
-
-			*reduce = f != ff;
-			break;
-		}
+	/* This is set if it's just whitespace. */
 
-		/* 
-		 * Trim spacing in the output.
-		 * This happens for (1) singleton text reduced children
-		 * and (2) text and node series.
-		 */
+	return 0 == buf->sz ? NULL : buf->b;
+}
 
-		for (i = 0; i < sz; i++)
-			if ( ! isspace((unsigned char)buf[i]))
-				break;
+/*
+ * Find the key of "q", as frag_serialise() would with minimisation and
+ * reduction, filling in "k".
+ * If "q" is keyed, the key's hash and length are composed from those
+ * recorded as the tree was built, so the key needn't be serialised:
+ * see frag_key_eq() to compare it.
+ * Otherwise, if "buf" is non-NULL, the key is serialised into it.
+ * Returns zero if there's nothing to translate.
+ */
+int
+frag_key(const struct fragseq *q, struct fragkey *k, struct buf *buf)
+{
+	const struct frag *first, *last;
+	int		   reduce;
+	uint64_t	   hb, he;
+	size_t		   kb, ke;
+	struct keyout	   ko;
+
+	memset(k, 0, sizeof(struct fragkey));
+
+	if (NULL == q->root || ! frag_minimise(q->root) ||
+	    ! frag_reduce(q->root, k, &reduce))
+		return 0;
+
+	if ( ! q->keyed) {
+		if (NULL == buf)
+			return 1;
+		buf->sz = 0;
+		memset(&ko, 0, sizeof(struct keyout));
+		ko.buf = buf;
+		frag_key_write(k, &ko);
+		k->key = buf->b;
+		k->len = buf->sz;
+		k->hash = key_hash(0, k->key, k->len);
+		return 1;
+	}
 
-		if (i < sz) {
-			memmove(buf, &buf[i], sz - i);
-			sz -= i;
-			buf[sz] = '\0';
-			for ( ; sz > 0; sz--) {
-				if ( ! isspace((unsigned char)buf[sz - 1]))
-					break;
-				buf[sz - 1] = '\0';
-			}
-			*reduce = 1;
-		} else if (i == sz)
-			sz = 0;
-	} else
-		frag_serialise_r(f, &buf, &sz, &max);
+	first = k->node->child[k->first];
+	last = k->node->child[k->last - 1];
 
-	/* This is set if it's just whitespace. */
+	hb = key_hash(first->hbeg, first->val, k->lead);
+	kb = first->kbeg + k->lead;
+	he = key_unhash(last->hend, 
+		last->val + last->valsz - k->trail, k->trail);
+	ke = last->kend - k->trail;
 
-	if (0 == sz) {
-		free(buf);
-		return NULL;
-	} 
+	k->len = ke - kb;
+	k->hash = key_hash_span(hb, kb, he, ke);
+	return 1;
+}
 
-	return buf;
+/*
+ * Whether the key "k" is the "sz" bytes of "s".
+ * Unless the key was serialised, this compares while serialising it
+ * afresh, stopping at the first difference.
+ */
+int
+frag_key_eq(const struct fragkey *k, const char *s, size_t sz)
+{
+	struct keyout	 ko;
+
+	if (sz != k->len)
+		return 0;
+	else if (NULL != k->key)
+		return 0 == memcmp(k->key, s, sz);
+
+	memset(&ko, 0, sizeof(struct keyout));
+	ko.cmp = s;
+	ko.cmpsz = sz;
+	frag_key_write(k, &ko);
+	return ! ko.neq && ko.sz == sz;
 }
 
+/*
+ * Close element "name" of length "sz".
+ */
 static void
-frag_print_reduced(const struct frag *f)
+frag_print_end(struct sink *out, const char *name, size_t sz)
+{
+
+	sink_write(out, "</", 2);
+	sink_write(out, name, sz);
+	sink_putc(out, '>');
+}
+
+static void
+frag_print_reduced(struct sink *out, const struct frag *f)
 {
 	const char	**attp;
 
 	if (FRAG_TEXT == f->type) {
 		assert(f->val);
-		printf("%.*s", (int)f->valsz, f->val);
+		sink_write(out, f->val, f->valsz);
 		return;
 	}
 
 	assert(FRAG_NODE == f->type);
 	assert(f->childsz < 2);
 
-	printf("<%.*s", (int)f->valsz, f->val);
+	sink_putc(out, '<');
+	sink_write(out, f->val, f->valsz);
 	attp = (const char **)f->atts;
 	for ( ; NULL != *attp; attp += 2)
-		printf(" %s=\"%s\"", attp[0], attp[1]);
+		sink_attr(out, attp[0], attp[1]);
 	if (f->is_null)
-		putchar('/');
-	putchar('>');
+		sink_putc(out, '/');
+	sink_putc(out, '>');
 	if (f->childsz) {
 		assert( ! f->is_null);
-		frag_print_reduced(f->child[0]);
+		frag_print_reduced(out, f->child[0]);
 	}
 	if ( ! f->is_null)
-		printf("</%.*s>", (int)f->valsz, f->val);
-}
-
-/*
- * When writing the attribute "key" during translation, where "key" is
- * one of the attributes mapped into the translation source (e.g., <x>
- * -> <img /> or whatnot), then make sure we haven't overwritten "key"
- * in the translated values with "xhtml:key".
- * Fill the value, if found, into "valp", otherwise leave it be. 
- */
-static void
-frag_match(const struct frag *trans, 
-	const char *key, const char **valp)
-{
-	size_t		 sz;
-	char *const 	*attp;
-
-	if (NULL == trans->atts) 
-		return;
-
-	for (attp = trans->atts; NULL != *attp; attp += 2) {
-		sz = strlen(attp[0]);
-		if (sz > 6 && 
-		    0 == strncmp("xhtml:", attp[0], 6) &&
-		    0 == strcmp(attp[0] + 6, key))
-			break;
-	}
-
-	if (NULL == *attp)
-		return;
-
-	*valp = attp[1];
+		frag_print_end(out, f->val, f->valsz);
 }
 
 static const struct frag *
@@ -606,64 +936,135 @@ frag_lookup(const struct fragseq *src, const struct frag *f)
 	return f;
 }
 
-static void
-frag_write_seq(const struct fragseq *src,
-	const struct frag *f)
+/*
+ * Like frag_lookup(), but for node "n" in the translation "t".
+ * Returns the mapped element in "src" or NULL if "n" is not mapped,
+ * in which case it should be printed as-is.
+ */
+static const struct frag *
+frag_flat_lookup(const struct fragseq *src, 
+	const struct ftarget *t, const struct fnode *n)
 {
-	const struct frag *rf = f;
-	size_t		  i;
-	const char	**attp;
-	const char	 *val;
+	size_t		  i, id;
+	const char	 *er, *val = t->strs + n->val;
 
-	if (FRAG_TEXT == f->type) {
-		assert(f->val);
-		printf("%.*s", (int)f->valsz, f->val);
+	if (strcasecmp(val, "x") && strcasecmp(val, "g")) 
+		return NULL;
+
+	for (i = 0; i < n->attsz; i++)
+		if (0 == strcmp(t->strs + t->atts[n->atts + i].key, "id"))
+			break;
+
+	if (i == n->attsz) 
+		return NULL;
+
+	id = strtonum(t->strs + t->atts[n->atts + i].val, 
+		0, INT_MAX, &er);
+	if (NULL == er && id < src->elemsz)
+		return src->elems[id];
+
+	return NULL;
+}
+
+/*
+ * When writing the attribute "key" during translation, where "key" is
+ * one of the attributes mapped into the translation source (e.g., <x>
+ * -> <img /> or whatnot), then make sure we haven't overwritten "key"
+ * in the translated values with "xhtml:key".
+ * Return the value, if found, otherwise NULL.
+ */
+static const char *
+frag_match(const struct ftarget *t, 
+	const struct fnode *n, const char *key)
+{
+	size_t		 i;
+	const char	*cp;
+
+	for (i = 0; i < n->attsz; i++) {
+		cp = t->strs + t->atts[n->atts + i].key;
+		if (strlen(cp) > 6 && 
+		    0 == strncmp("xhtml:", cp, 6) &&
+		    0 == strcmp(cp + 6, key))
+			return t->strs + t->atts[n->atts + i].val;
+	}
+
+	return NULL;
+}
+
+/*
+ * Write node "i" of the translation "t", and its descendents, mapping
+ * any placeholder elements back into the source "src".
+ */
+static void
+frag_write_seq(struct sink *out, const struct fragseq *src,
+	const struct ftarget *t, size_t i)
+{
+	const struct fnode *n = &t->nodes[i];
+	const struct frag  *rf = NULL;
+	size_t		    j;
+	const char	  **attp;
+	const char	   *val;
+
+	if (FRAG_TEXT == n->type) {
+		sink_write(out, t->strs + n->val, n->valsz);
 		return;
 	}
 
-	if (FRAG_NODE == f->type) {
-		rf = frag_lookup(src, f);
-		printf("<%.*s", (int)rf->valsz, rf->val);
+	if (FRAG_NODE == n->type &&
+	    NULL != (rf = frag_flat_lookup(src, t, n))) {
+		sink_putc(out, '<');
+		sink_write(out, rf->val, rf->valsz);
 		attp = (const char **)rf->atts;
 		for ( ; NULL != *attp; attp += 2) {
-			val = attp[1];
-			if (rf != f)
-				frag_match(f, attp[0], &val);
-			printf(" %s=\"%s\"", attp[0], val);
+			if (NULL == (val = frag_match(t, n, attp[0])))
+				val = attp[1];
+			sink_attr(out, attp[0], val);
 		}
 		if (rf->is_null)
-			putchar('/');
-		putchar('>');
+			sink_putc(out, '/');
+		sink_putc(out, '>');
+	} else if (FRAG_NODE == n->type) {
+		sink_putc(out, '<');
+		sink_write(out, t->strs + n->val, n->valsz);
+		for (j = 0; j < n->attsz; j++)
+			sink_attr(out,
+				t->strs + t->atts[n->atts + j].key,
+				t->strs + t->atts[n->atts + j].val);
+		if (n->is_null)
+			sink_putc(out, '/');
+		sink_putc(out, '>');
 	}
 
-	for (i = 0; i < f->childsz; i++)
-		frag_write_seq(src, f->child[i]);
+	for (j = i + 1; j < n->end; j = t->nodes[j].end)
+		frag_write_seq(out, src, t, j);
 
-	if (FRAG_NODE == f->type && ! f->is_null)
-		printf("</%.*s>", (int)rf->valsz, rf->val);
+	if (FRAG_NODE == n->type && ! n->is_null && NULL != rf)
+		frag_print_end(out, rf->val, rf->valsz);
+	else if (FRAG_NODE == n->type && ! n->is_null)
+		frag_print_end(out, t->strs + n->val, n->valsz);
 }
 
 static void
-frag_print_merge_r(const struct fragseq *src,
-	const struct frag *f, const char *source, 
-	const struct fragseq *target)
+frag_print_merge_r(struct sink *out, const struct fragseq *src,
+	const struct frag *f, const struct ftarget *target)
 {
-	size_t	 	  i, nn = 0, nt = 0, sz;
+	size_t	 	  i, sz;
 	const struct frag *rf = f;
 	const char 	**attp;
 	const char	 *cp;
 
 	if (FRAG_NODE == f->type) {
 		rf = frag_lookup(src, f);
-		printf("<%.*s", (int)rf->valsz, rf->val);
+		sink_putc(out, '<');
+		sink_write(out, rf->val, rf->valsz);
 		attp = (const char **)rf->atts;
 		for ( ; NULL != *attp; attp += 2)
-			printf(" %s=\"%s\"", attp[0], attp[1]);
+			sink_attr(out, attp[0], attp[1]);
 		if (f->is_null) {
-			putchar('/');
+			sink_putc(out, '/');
 			assert(0 == f->childsz);
 		}
-		putchar('>');
+		sink_putc(out, '>');
 		if (f->is_null) 
 			return;
 	}
@@ -679,34 +1080,27 @@ frag_print_merge_r(const struct fragseq *src,
 		cp = f->child[0]->val;
 		sz = f->child[0]->valsz;
 		if (sz && isspace((unsigned char)cp[0]))
-			putchar(' ');
+			sink_putc(out, ' ');
 
-		frag_write_seq(src, target->root);
+		frag_write_seq(out, src, target, 0);
 		/*printf("%s", target);*/
 
 		if (sz && isspace((unsigned char)cp[sz - 1]))
-			putchar(' ');
+			sink_putc(out, ' ');
 		goto out;
 	}
 
-	/* See if we're going to recursively step. */
-
-	for (i = 0; i < f->childsz; i++) {
-		nn += FRAG_NODE == f->child[i]->type;
-		nt += FRAG_TEXT == f->child[i]->type &&
-			0 == f->child[i]->has_nonws;
-	}
-
 	/* 
-	 * The algorithm is complete.
+	 * Unless we're going to recursively step, the algorithm is
+	 * complete.
 	 * Make sure we account for surrounding white-space.
 	 */
 
-	if (1 != nn || nn + nt != f->childsz) {
+	if (NULL == frag_wrapper(f)) {
 		for (i = 0; i < f->childsz; i++)  {
 			if ( ! frag_canreduce(f->child[i]))
 				break;
-			frag_print_reduced(f->child[i]);
+			frag_print_reduced(out, f->child[i]);
 		}
 
 		if (i < f->childsz &&
@@ -714,15 +1108,15 @@ frag_print_merge_r(const struct fragseq *src,
 		    f->child[i]->valsz &&
 		    f->child[i]->has_nonws &&
 		    isspace((unsigned char)f->child[i]->val[0]))
-			putchar(' ');
+			sink_putc(out, ' ');
 
-		frag_write_seq(src, target->root);
+		frag_write_seq(out, src, target, 0);
 		/*printf("%s", target);*/
 
 		for (i = f->childsz; i > 0; i--)  {
 			if ( ! frag_canreduce(f->child[i - 1]))
 				break;
-			frag_print_reduced(f->child[i - 1]);
+			frag_print_reduced(out, f->child[i - 1]);
 		}
 
 		if (i > 0 &&
@@ -732,7 +1126,7 @@ frag_print_merge_r(const struct fragseq *src,
 			cp = f->child[i - 1]->val;
 			sz = f->child[i - 1]->valsz;
 			if (isspace((unsigned char)cp[sz - 1]))
-				putchar(' ');
+				sink_putc(out, ' ');
 		}
 		goto out;
 	}
@@ -741,47 +1135,187 @@ frag_print_merge_r(const struct fragseq *src,
 
 	for (i = 0; i < f->childsz; i++)
 		if (FRAG_NODE == f->child[i]->type)
-			frag_print_merge_r(src,
-				f->child[i], source, target);
+			frag_print_merge_r(out, src,
+				f->child[i], target);
 		else
-			printf("%.*s", (int)f->child[i]->valsz,
-				f->child[i]->val);
+			sink_write(out, f->child[i]->val,
+				f->child[i]->valsz);
 out:
 	if (FRAG_NODE == f->type)
-		printf("</%.*s>", (int)rf->valsz, rf->val);
+		frag_print_end(out, rf->val, rf->valsz);
 }
 
 /*
- * Take a fragment "q" and a "source" that matches into some part of the
- * post-reduced "q".
- * Find the "source" in "q" by reversing the reduction and emitting the
+ * Take a fragment "q" whose reduced key (see frag_key()) matches the
+ * source of "target".
+ * Find the key in "q" by reversing the reduction and emitting the
  * "target" instead.
- * If "source" is NULL, it's not reduced.
  * This should ONLY be run on reduced trees.
+ * Output is written to "out".
  */
 void
-frag_print_merge(const struct fragseq *q, 
-	const char *source, const struct fragseq *target)
+frag_print_merge(struct sink *out, const struct fragseq *q, 
+	const struct ftarget *target)
 {
 
-	if (NULL == source)
-		frag_write_seq(q, target->root);
-	else
-		frag_print_merge_r(q, q->root, source, target);
+	frag_print_merge_r(out, q, q->root, target);
 }
 
 /*
- * Clear "p", but do not free() it.
+ * Clear "p" for the next sequence, but do not free() it.
+ * The arena, element list, and copy buffer are kept for reuse.
  */
 void
 fragseq_clear(struct fragseq *p)
 {
 
-	frag_node_free(p->root);
-	free(p->copy);
-	free(p->elems);
+	arena_reset(&p->arena);
 	p->root = p->cur = NULL;
-	p->copy = NULL;
+	p->copy.sz = p->elemsz = 0;
+	p->khash = 0;
+	p->ksz = 0;
+}
+
+/*
+ * Clear "p" and free all of its storage, but do not free() it.
+ */
+void
+fragseq_free(struct fragseq *p)
+{
+
+	fragseq_clear(p);
+	arena_free(&p->arena);
+	arena_free(&p->names.arena);
+	free(p->names.tab);
+	slots_free(&p->names.idx);
+	p->names.tab = NULL;
+	p->names.count = p->names.max = 0;
+	buf_free(&p->copy);
+	free(p->elems);
 	p->elems = NULL;
-	p->copysz = p->elemsz = 0;
+	p->elemmax = 0;
+}
+
+/*
+ * Append the string "s" of length "len" to the string table of "tab",
+ * returning its offset.
+ */
+uint32_t
+ftable_str(struct ftable *tab, const char *s, size_t len)
+{
+	size_t	 off = tab->strsz;
+
+	if (tab->strsz + len + 1 > UINT32_MAX)
+		errx(EXIT_FAILURE, "string table too large");
+
+	if (tab->strsz + len + 1 > tab->strmax) {
+		tab->strmax = tab->strmax > 2048 ? tab->strmax * 2 : 4096;
+		if (tab->strsz + len + 1 > tab->strmax)
+			tab->strmax = tab->strsz + len + 1;
+		tab->strs = realloc(tab->strs, tab->strmax);
+		if (NULL == tab->strs)
+			err(EXIT_FAILURE, NULL);
+	}
+
+	if (len > 0)
+		memcpy(tab->strs + tab->strsz, s, len);
+	tab->strs[tab->strsz + len] = '\0';
+	tab->strsz += len + 1;
+	return off;
+}
+
+/*
+ * Recursively flatten "f" into "tab", where "root" is the index of the
+ * root node of the translation.
+ */
+static void
+frag_flatten_r(const struct frag *f, struct ftable *tab, size_t root)
+{
+	size_t		 id = tab->nodesz, i, attsz = 0;
+	struct fnode	*n;
+
+	if (tab->nodesz - root >= UINT32_MAX)
+		errx(EXIT_FAILURE, "translation too large");
+
+	if (tab->nodesz + 1 > tab->nodemax) {
+		tab->nodemax = tab->nodemax ? tab->nodemax * 2 : 512;
+		tab->nodes = reallocarray(tab->nodes, 
+			tab->nodemax, sizeof(struct fnode));
+		if (NULL == tab->nodes)
+			err(EXIT_FAILURE, NULL);
+	}
+
+	if (NULL != f->atts)
+		while (NULL != f->atts[attsz * 2])
+			attsz++;
+
+	if (tab->attsz + attsz > UINT32_MAX)
+		errx(EXIT_FAILURE, "attribute table too large");
+
+	if (tab->attsz + attsz > tab->attmax) {
+		tab->attmax = tab->attmax ? tab->attmax * 2 : 512;
+		if (tab->attsz + attsz > tab->attmax)
+			tab->attmax = tab->attsz + attsz;
+		tab->atts = reallocarray(tab->atts,
+			tab->attmax, sizeof(struct fattr));
+		if (NULL == tab->atts)
+			err(EXIT_FAILURE, NULL);
+	}
+
+	n = &tab->nodes[tab->nodesz++];
+	memset(n, 0, sizeof(struct fnode));
+	n->type = f->type;
+	n->is_null = f->is_null;
+	n->valsz = f->valsz;
+	n->atts = tab->attsz;
+	n->attsz = attsz;
+
+	/* Don't use "n" after this: the string table may move. */
+
+	tab->nodes[id].val = ftable_str(tab, f->val, f->valsz);
+	for (i = 0; i < attsz; i++) {
+		tab->atts[tab->attsz].key = ftable_str(tab, 
+			f->atts[i * 2], strlen(f->atts[i * 2]));
+		tab->atts[tab->attsz].val = ftable_str(tab, 
+			f->atts[i * 2 + 1], strlen(f->atts[i * 2 + 1]));
+		tab->attsz++;
+	}
+
+	for (i = 0; i < f->childsz; i++)
+		frag_flatten_r(f->child[i], tab, root);
+
+	tab->nodes[id].end = tab->nodesz - root;
+}
+
+/*
+ * Flatten the translation "q" into the tables "tab", setting the index
+ * of its root node and the number of nodes.
+ * This does nothing if "q" is empty.
+ */
+void
+frag_flatten(const struct fragseq *q, 
+	struct ftable *tab, size_t *node, size_t *nodesz)
+{
+
+	*node = tab->nodesz;
+	*nodesz = 0;
+
+	if (NULL == q->root)
+		return;
+
+	frag_flatten_r(q->root, tab, tab->nodesz);
+	*nodesz = tab->nodesz - *node;
+}
+
+/*
+ * Clear "tab", but do not free() it.
+ */
+void
+ftable_clear(struct ftable *tab)
+{
+
+	free(tab->nodes);
+	free(tab->atts);
+	free(tab->strs);
+	memset(tab, 0, sizeof(struct ftable));
 }
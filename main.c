@@ -16,6 +16,8 @@
  */
 #include "config.h"
 
+#include <sys/stat.h>
+
 #include <assert.h>
 #if HAVE_SANDBOX_INIT
 # include <sandbox.h>
@@ -23,18 +25,19 @@
 #if HAVE_ERR
 # include <err.h>
 #endif
+#include <errno.h>
 #include <expat.h>
 #include <getopt.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#if HAVE_PLEDGE
-# include <unistd.h>
-#endif
+#include <unistd.h>
 
 #include "extern.h"
 
 enum	op {
+	OP_COMPILE,
 	OP_JOIN,
 	OP_EXTRACT,
 	OP_UPDATE
@@ -42,7 +45,7 @@ enum	op {
 
 #if HAVE_SANDBOX_INIT
 static void
-sandbox(void)
+sandbox(const char *promises)
 {
 	char	*ep;
 	int	 rc;
@@ -56,53 +59,131 @@ sandbox(void)
 }
 #elif HAVE_PLEDGE
 static void
-sandbox(void)
+sandbox(const char *promises)
 {
 
-	if (-1 == pledge("stdio rpath", NULL))
+	if (-1 == pledge(promises, NULL))
 		err(EXIT_FAILURE, "pledge");
 }
 #else
 static void
-sandbox(void)
+sandbox(const char *promises)
 {
 	/* Do nothing at all. */
 }
 #endif
 
+/*
+ * Make sure "dir", given with "flag", is a directory we can create
+ * files in, so runs fail up front rather than on the first file.
+ */
+static void
+dircheck(const char *flag, const char *dir)
+{
+	struct stat	 st;
+
+	if (-1 == stat(dir, &st))
+		err(EXIT_FAILURE, "%s: %s", flag, dir);
+	if ( ! S_ISDIR(st.st_mode))
+		errc(EXIT_FAILURE, ENOTDIR, "%s: %s", flag, dir);
+	if (-1 == access(dir, W_OK | X_OK))
+		err(EXIT_FAILURE, "%s: %s", flag, dir);
+}
+
 int
 main(int argc, char *argv[])
 {
-	int		 ch, rc, keep = 0, copy = 0, quiet = 0;
-	const char	*xliff = NULL;
+	int		 ch, rc;
+	const char	*xliff = NULL, *sock = NULL, *er;
+	struct catname	*cats = NULL;
+	size_t		 catsz = 0;
 	enum op	 	 op = OP_EXTRACT;
 	XML_Parser	 p;
+	struct opts	 o;
 
-	sandbox();
+	memset(&o, 0, sizeof(struct opts));
 
-	while (-1 != (ch = getopt(argc, argv, "cej:kqu:")))
+	while (-1 != (ch = getopt(argc, argv, "C:ceI:j:J:km:o:P:qR:S:t:u:vX:x:")))
 		switch (ch) {
+		case 'C':
+			op = OP_COMPILE;
+			xliff = optarg;
+			break;
 		case 'c':
-			copy = 1;
+			o.copy = 1;
 			break;
 		case 'e':
 			op = OP_EXTRACT;
 			xliff = NULL;
 			break;
+		case 'I':
+			o.incs = reallocarray(o.incs,
+				o.incsz + 1, sizeof(char *));
+			if (NULL == o.incs)
+				err(EXIT_FAILURE, NULL);
+			o.incs[o.incsz++] = optarg;
+			break;
 		case 'k':
-			keep = 1;
+			o.keep = 1;
 			break;
 		case 'j':
+		case 'J':
 			op = OP_JOIN;
-			xliff = optarg;
+			cats = reallocarray(cats, 
+				catsz + 1, sizeof(struct catname));
+			if (NULL == cats)
+				err(EXIT_FAILURE, NULL);
+			cats[catsz].fname = optarg;
+			cats[catsz++].compiled = 'J' == ch;
+			break;
+		case 'm':
+			o.budget = strtonum(optarg, 1,
+				SIZE_MAX / (1024 * 1024), &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-m: %s", er);
+			o.budget *= 1024 * 1024;
+			break;
+		case 'o':
+			o.outdir = optarg;
+			break;
+		case 'P':
+			o.jobs = strtonum(optarg, 1, 1024, &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-P: %s", er);
 			break;
 		case 'q':
-			quiet = 1;
+			o.quiet = 1;
+			break;
+		case 'R':
+			o.dirs = reallocarray(o.dirs,
+				o.dirsz + 1, sizeof(char *));
+			if (NULL == o.dirs)
+				err(EXIT_FAILURE, NULL);
+			o.dirs[o.dirsz++] = optarg;
+			break;
+		case 'S':
+			sock = optarg;
+			break;
+		case 't':
+			o.outtmpl = optarg;
 			break;
 		case 'u':
 			op = OP_UPDATE;
 			xliff = optarg;
 			break;
+		case 'v':
+			o.verbose = 1;
+			break;
+		case 'X':
+			o.excs = reallocarray(o.excs,
+				o.excsz + 1, sizeof(char *));
+			if (NULL == o.excs)
+				err(EXIT_FAILURE, NULL);
+			o.excs[o.excsz++] = optarg;
+			break;
+		case 'x':
+			o.cache = optarg;
+			break;
 		default:
 			goto usage;
 		}
@@ -110,31 +191,104 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	/* The server only translates, and only from its socket. */
+
+	if (NULL != sock &&
+	    (OP_JOIN != op || 0 != argc || 0 != o.dirsz ||
+	     NULL != o.outdir))
+		goto usage;
+
+	/* Only scanning uses the cache. */
+
+	if ((OP_JOIN == op || OP_COMPILE == op) && NULL != o.cache)
+		goto usage;
+
+	/* Otherwise, each input would fail to use the cache. */
+
+	if (NULL != o.cache)
+		dircheck("-x", o.cache);
+
+	/* Otherwise, the first output would fail to be written. */
+
+	if (OP_JOIN == op && NULL != o.outdir)
+		dircheck("-o", o.outdir);
+
+	/* Compiling and output directories need to create files. */
+
+	if (OP_COMPILE == op) {
+		if (1 != argc || 0 != o.dirsz)
+			goto usage;
+		sandbox("stdio rpath wpath cpath");
+	} else if (OP_JOIN == op && NULL != o.outdir) {
+		if (0 == argc && 0 == o.dirsz)
+			goto usage;
+		sandbox("stdio rpath wpath cpath");
+	} else if (OP_JOIN != op &&
+	    (NULL != o.cache || 0 != o.budget)) {
+		/* Spilled words go into temporary files. */
+		sandbox("stdio rpath wpath cpath");
+	} else if (NULL != sock) {
+#if ! HAVE_SANDBOX_INIT
+		/* The no-network profile would deny the socket. */
+		sandbox("stdio rpath cpath unix");
+#endif
+	} else
+		sandbox("stdio rpath");
+
+	if (NULL == o.outtmpl)
+		o.outtmpl = "%b.%l.html";
+
+	/* Multiple catalogs each need their own output files. */
+
+	if (OP_JOIN == op && catsz > 1 && NULL == sock) {
+		if (NULL == o.outdir)
+			errx(EXIT_FAILURE, "multiple catalogs "
+				"require an output directory");
+		if (NULL == strstr(o.outtmpl, "%l"))
+			errx(EXIT_FAILURE, "multiple catalogs "
+				"require %%l in the output template");
+	}
+
 	if (NULL == (p = XML_ParserCreate(NULL)))
 		errx(EXIT_FAILURE, "XML_ParserCreate");
 
 	switch (op) {
+	case (OP_COMPILE):
+		assert(NULL != xliff);
+		rc = compile(xliff, p, argv[0]);
+		break;
 	case (OP_EXTRACT):
-		rc = extract(p, copy, argc, argv);
+		rc = extract(p, &o, argc, argv);
 		break;
 	case (OP_JOIN):
-		assert(NULL != xliff);
-		rc = join(xliff, p, copy, argc, argv);
+		assert(catsz > 0);
+		if (NULL != sock)
+			rc = serve(cats, catsz, p, &o, sock);
+		else
+			rc = join(cats, catsz, p, &o, argc, argv);
 		break;
 	case (OP_UPDATE):
 		assert(NULL != xliff);
-		rc = update(xliff, p, copy, 
-			keep, quiet, argc, argv);
+		rc = update(xliff, p, &o, argc, argv);
 		break;
 	default:
 		abort();
 	}
 
 	XML_ParserFree(p);
+	free(cats);
+	free(o.dirs);
+	free(o.incs);
+	free(o.excs);
 	return rc ? EXIT_SUCCESS : EXIT_FAILURE;
 
 usage:
-	fprintf(stderr, "usage: %s [-cekq] "
-		"[-j xliff] [-u xliff] html5...\n", getprogname());
+	fprintf(stderr, "usage: %s [-cekqv] [-I glob] [-J catalog] "
+		"[-j xliff] [-m mbytes] [-o dir] [-P jobs]\n"
+		"             [-R dir] [-t template] [-u xliff] "
+		"[-X glob] [-x cachedir] html5...\n"
+		"       %s -C xliff catalog\n"
+		"       %s [-c] [-J catalog] [-j xliff] -S socket\n",
+		getprogname(), getprogname(), getprogname());
 	return EXIT_FAILURE;
 }
@@ -0,0 +1,169 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <assert.h>
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <expat.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extern.h"
+
+/*
+ * When passing input through, a segment's translation replaces exactly
+ * its input bytes, and depends only on them and on whether white-space
+ * was being preserved.
+ * So pages sharing headers, navigation, and so on needn't have those
+ * parsed into keys, looked up, and rendered more than once: the output
+ * of each translated segment is kept here by its input.
+ * This is per output, as each has its own catalog.
+ */
+
+/*
+ * Most data (inputs and outputs) kept per output.
+ * Once full, new segments aren't added.
+ */
+#define	MEMO_MAX	(32 * 1024 * 1024)
+
+/*
+ * An input being looked up in a memo.
+ */
+struct	memokey {
+	const struct memo *m;
+	uint64_t	   hash; /* key_hash() of input */
+	int		   preserve; /* whether preserving white-space */
+	const char	  *in; /* input */
+	size_t		   insz; /* length of input */
+};
+
+static int
+memo_eq(const void *arg, size_t i)
+{
+	const struct memokey *k = arg;
+	const struct memoent *e = &k->m->ents[i];
+
+	return e->hash == k->hash && e->preserve == k->preserve &&
+		e->insz == k->insz &&
+		0 == memcmp(k->m->data.b + e->in, k->in, k->insz);
+}
+
+static uint64_t
+memo_hash(const void *arg, size_t i)
+{
+	const struct memo *m = arg;
+
+	return m->ents[i].hash;
+}
+
+/*
+ * Find the slot for the input "in" of length "insz" and hash "h".
+ */
+static size_t
+memo_find(const struct memo *m, uint64_t h, int preserve,
+	const char *in, size_t insz)
+{
+	struct memokey	 k;
+	size_t		 j;
+
+	k.m = m;
+	k.hash = h;
+	k.preserve = preserve;
+	k.in = in;
+	k.insz = insz;
+
+	j = slots_find(m->idx.slot, m->idx.bits, h, memo_eq, &k, NULL);
+	assert(SIZE_MAX != j);
+	return j;
+}
+
+/*
+ * Look up the output for the input "in" of length "insz" and hash "h".
+ * Returns the output, filling in its length, or NULL if not found.
+ */
+const char *
+memo_get(const struct memo *m, uint64_t h, int preserve,
+	const char *in, size_t insz, size_t *outsz)
+{
+	const struct memoent *e;
+	size_t		      j;
+
+	if (NULL == m->idx.slot)
+		return NULL;
+
+	j = memo_find(m, h, preserve, in, insz);
+	if (0 == m->idx.slot[j])
+		return NULL;
+
+	e = &m->ents[m->idx.slot[j] - 1];
+	*outsz = e->outsz;
+	return m->data.b + e->out;
+}
+
+/*
+ * Remember that the input "in" of length "insz" and hash "h" was
+ * translated into "out" of length "outsz", if not already known.
+ */
+void
+memo_put(struct memo *m, uint64_t h, int preserve,
+	const char *in, size_t insz, const char *out, size_t outsz)
+{
+	struct memoent	*e;
+	size_t		 j;
+
+	if (m->data.sz + insz + outsz > MEMO_MAX)
+		return;
+
+	slots_reserve(&m->idx, m->entsz + 1, 8, memo_hash, m);
+	j = memo_find(m, h, preserve, in, insz);
+	if (0 != m->idx.slot[j])
+		return;
+
+	if (m->entsz == m->entmax) {
+		m->entmax = 0 == m->entmax ? 64 : m->entmax * 2;
+		m->ents = reallocarray(m->ents,
+			m->entmax, sizeof(struct memoent));
+		if (NULL == m->ents)
+			err(EXIT_FAILURE, NULL);
+	}
+
+	e = &m->ents[m->entsz];
+	e->hash = h;
+	e->preserve = preserve;
+	e->in = m->data.sz;
+	e->insz = insz;
+	buf_append(&m->data, in, insz);
+	e->out = m->data.sz;
+	e->outsz = outsz;
+	buf_append(&m->data, out, outsz);
+
+	m->idx.slot[j] = ++m->entsz;
+}
+
+void
+memo_free(struct memo *m)
+{
+
+	free(m->ents);
+	slots_free(&m->idx);
+	buf_free(&m->data);
+	memset(m, 0, sizeof(struct memo));
+}
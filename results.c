@@ -24,172 +24,167 @@
 
 #include "extern.h"
 
+/*
+ * Order translation units (by index into "xcmp_xliffs") by their source
+ * and then by their position in the catalog.
+ * The latter makes the first of any duplicate sources sort first.
+ */
+static const struct xliff *xcmp_xliffs;
+
 static int
 xcmp(const void *p1, const void *p2)
 {
-	const struct xliff *x1 = p1, *x2 = p2;
+	size_t	 i1 = *(const size_t *)p1, i2 = *(const size_t *)p2;
+	int	 rc;
 
-	return strcmp(x1->source, x2->source);
+	rc = strcmp(xcmp_xliffs[i1].source, xcmp_xliffs[i2].source);
+	if (0 != rc)
+		return rc;
+	return i1 < i2 ? -1 : i1 > i2;
 }
 
-static int
-cmp(const void *p1, const void *p2)
+/*
+ * Print a translation unit.
+ * If there's no target "copy", the source is used if "copysrc".
+ */
+static void
+unit_print(size_t id, const char *source,
+	const char *copy, size_t copysz, int copysrc)
 {
-	const struct word *x1 = p1, *x2 = p2;
 
-	return strcmp(x1->source, x2->source);
+	printf("\t\t\t<trans-unit id=\"%zu\">\n"
+	       "\t\t\t\t<source>%s</source>\n", id, source);
+	if (0 != copysz)
+		printf("\t\t\t\t<target>%.*s</target>\n",
+			(int)copysz, copy);
+	else if (copysrc)
+		printf("\t\t\t\t<target>%s</target>\n", source);
+	puts("\t\t\t</trans-unit>");
 }
 
+/*
+ * Reconcile the words found in the input, which come sorted and unique
+ * from words_next(), with the existing XLIFF by sorting it and walking
+ * both in a single merge.
+ * Words not in the XLIFF are new; XLIFF entries not in the words are
+ * unused and either discarded or kept.
+ * The merged output is in sorted order and printed as it's merged.
+ */
 void
 results_update(struct hparse *hp, int copy, int keep, int quiet)
 {
-	char		*cp;
-	size_t	 	 i, j, ssz, smax;
-	struct xliff	*sorted;
-
-	/* Allows us to de-dupe in place. */
+	const struct xparse *xp = hp->xp;
+	const struct xliff *x;
+	const struct word *w;
+	size_t	 	 j, k, n = 0;
+	size_t		*idx;
+	int		 c;
+	char		*unused;
+
+	/* Sort the XLIFF by index so we can flag unused entries. */
+
+	idx = reallocarray(NULL, xp->xliffsz + 1, sizeof(size_t));
+	unused = calloc(xp->xliffsz + 1, 1);
+	if (NULL == idx || NULL == unused) {
+		perror(NULL);
+		exit(EXIT_FAILURE);
+	}
 
-	qsort(hp->words, hp->wordsz, sizeof(struct word), cmp);
+	for (j = 0; j < xp->xliffsz; j++)
+		idx[j] = j;
+	xcmp_xliffs = xp->xliffs;
+	qsort(idx, xp->xliffsz, sizeof(size_t), xcmp);
 
-	sorted = NULL;
-	ssz = smax = 0;
+	printf("<xliff version=\"1.2\">\n"
+	       "\t<file source-language=\"%s\" "
+	          "target-language=\"%s\" tool=\"sintl\">\n"
+	       "\t\t<body>\n",
+	       NULL == xp->srclang ? "TODO" : xp->srclang,
+	       NULL == xp->trglang ? "TODO" : xp->trglang);
 
-	/* Merge found words in input into the merge buffer. */
+	j = 0;
+	w = words_next(hp);
 
-	for (i = 0; i < hp->wordsz; i++) {
-		cp = hp->words[i].source;
-		if (i && 0 == strcmp(cp, hp->words[i - 1].source))
+	while (NULL != w || j < xp->xliffsz) {
+		if (NULL == w)
+			c = 1;
+		else if (j == xp->xliffsz)
+			c = -1;
+		else
+			c = strcmp(w->source, xp->xliffs[idx[j]].source);
+
+		if (c > 0) {
+			/* In the XLIFF but not in the input. */
+			x = &xp->xliffs[idx[j]];
+			unused[idx[j]] = 1;
+			if (keep)
+				unit_print(++n, x->source,
+					x->copy, x->copysz, copy);
+			j++;
 			continue;
-		if (ssz + 1 > smax) {
-			smax = ssz + 512;
-			sorted = reallocarray(sorted, 
-				smax, sizeof(struct xliff));
-			if (NULL == sorted) {
-				perror(NULL);
-				exit(EXIT_FAILURE);
-			}
 		}
 
 		/* 
 		 * Are we finding this in the xliff?
-		 * If so, use the xliff's target information.
+		 * If so, use the xliff's target information and skip
+		 * any duplicates in the XLIFF.
 		 * Otherwise, copy only the source.
 		 */
 
-		for (j = 0; j < hp->xp->xliffsz; j++)
-			if (0 == strcmp(cp, hp->xp->xliffs[j].source))
-				break;
-
-		if (j == hp->xp->xliffsz) {
+		if (c < 0) {
 			if ( ! quiet)
 				fprintf(stderr, "%s:%zu:%zu: "
 					"new translation\n",
-					hp->fname, hp->words[i].line,
-					hp->words[i].col);
-			memset(&sorted[ssz], 0, sizeof(struct xliff));
-			sorted[ssz].source = cp;
-		} else
-			sorted[ssz] = hp->xp->xliffs[j];
-
-		ssz++;
-	}
-
-	/* Merge from the existing XLIFF back into the words. */
-
-	for (i = 0; i < hp->xp->xliffsz; i++) {
-		cp = hp->xp->xliffs[i].source;
-		for (j = 0; j < hp->wordsz; j++)
-			if (0 == strcmp(cp, hp->words[j].source))
-				break;
-		if (j < hp->wordsz)
-			continue;
-	
-		if ( ! keep && ! quiet) {
-			fprintf(stderr, "%s:%zu:%zu: discarding "
-				"unused translation\n",
-				hp->xp->fname,
-				hp->xp->xliffs[i].line,
-				hp->xp->xliffs[i].col);
-			continue;
-		} else if ( ! keep)
-			continue;
-
-		if (ssz + 1 > smax) {
-			smax = ssz + 512;
-			sorted = reallocarray(sorted, 
-				smax, sizeof(struct xliff));
-			if (NULL == sorted) {
-				perror(NULL);
-				exit(EXIT_FAILURE);
-			}
+					hp->fname, w->line, w->col);
+			unit_print(++n, w->source, NULL, 0, copy);
+		} else {
+			x = &xp->xliffs[idx[j]];
+			unit_print(++n, x->source, x->copy, x->copysz, copy);
+			for (k = j + 1; k < xp->xliffsz; k++)
+				if (strcmp(xp->xliffs[idx[k]].source,
+				    x->source))
+					break;
+			j = k;
 		}
-		sorted[ssz++] = hp->xp->xliffs[i];
-	}
-
-	/* Output the sorted dictionary file. */
 
-	if (ssz)
-		qsort(sorted, ssz, sizeof(struct xliff), xcmp);
-
-	printf("<xliff version=\"1.2\">\n"
-	       "\t<file source-language=\"%s\" "
-	          "target-language=\"%s\" tool=\"sintl\">\n"
-	       "\t\t<body>\n",
-	       NULL == hp->xp->srclang ? "TODO" : hp->xp->srclang,
-	       NULL == hp->xp->trglang ? "TODO" : hp->xp->trglang);
-
-	for (i = 0; i < ssz; i++) 
-		if (0 == sorted[i].target.copysz && copy)
-			printf("\t\t\t<trans-unit id=\"%zu\">\n"
-			       "\t\t\t\t<source>%s</source>\n"
-			       "\t\t\t\t<target>%s</target>\n"
-			       "\t\t\t</trans-unit>\n",
-			       i + 1, sorted[i].source,
-			       sorted[i].source);
-		else if (0 == sorted[i].target.copysz)
-			printf("\t\t\t<trans-unit id=\"%zu\">\n"
-			       "\t\t\t\t<source>%s</source>\n"
-			       "\t\t\t</trans-unit>\n",
-			       i + 1, sorted[i].source);
-		else
-			printf("\t\t\t<trans-unit id=\"%zu\">\n"
-			       "\t\t\t\t<source>%s</source>\n"
-			       "\t\t\t\t<target>%.*s</target>\n"
-			       "\t\t\t</trans-unit>\n",
-			       i + 1, sorted[i].source,
-			       (int)sorted[i].target.copysz,
-			       sorted[i].target.copy);
+		w = words_next(hp);
+	}
 
 	puts("\t\t</body>");
 	puts("\t</file>");
 	puts("</xliff>");
 
-	free(sorted);
+	/* Note discarded entries in the order of the XLIFF. */
+
+	if ( ! keep && ! quiet)
+		for (j = 0; j < xp->xliffsz; j++)
+			if (unused[j])
+				fprintf(stderr, "%s:%zu:%zu: discarding "
+					"unused translation\n",
+					xp->fname, xp->xliffs[j].line,
+					xp->xliffs[j].col);
+
+	free(unused);
+	free(idx);
 }
 
+/*
+ * Emit an XLIFF template with the words found in the input, which come
+ * sorted and unique from words_next().
+ */
 void
 results_extract(struct hparse *p, int copy)
 {
-	size_t	 i, j;
-
-	qsort(p->words, p->wordsz, sizeof(struct word), cmp);
+	const struct word *w;
+	size_t		   n = 0;
 
 	printf("<xliff version=\"1.2\">\n"
 	       "\t<file source-language=\"%s\" "
 	          "target-language=\"TODO\" tool=\"sintl\">\n"
 	       "\t\t<body>\n",
 	       NULL == p->lang ? "TODO" : p->lang);
-	for (i = j = 0; i < p->wordsz; i++) {
-		if (i && 0 == strcmp(p->words[i].source, p->words[i - 1].source))
-			continue;
-		printf("\t\t\t<trans-unit id=\"%zu\">\n"
-		       "\t\t\t\t<source>%s</source>\n", 
-		       ++j, p->words[i].source);
-		if (copy)
-			printf("\t\t\t\t<target>%s</target>\n", 
-				p->words[i].source);
-		puts("\t\t\t</trans-unit>");
-	}
+	while (NULL != (w = words_next(p)))
+		unit_print(++n, w->source, NULL, 0, copy);
 	puts("\t\t</body>\n"
 	     "\t</file>\n"
 	     "</xliff>");
@@ -0,0 +1,476 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <assert.h>
+#include <errno.h>
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <expat.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+/*
+ * Requests larger than this are refused.
+ */
+#define	REQ_MAX		(64 * 1024 * 1024)
+
+/*
+ * Default number of requests served at once (see -P).
+ */
+#define	CONN_MAX	64
+
+/*
+ * Seconds a client may leave a connection idle, reading or writing,
+ * before it's dropped.
+ */
+#define	CONN_TIMEOUT	30
+
+/*
+ * A loaded dictionary.
+ * Requests hold a reference while translating, so a dictionary that's
+ * been reloaded is only freed once its last request finishes.
+ */
+struct	loaded {
+	struct xparse	*xp; /* dictionary */
+	size_t		 refs; /* references (catalog and requests) */
+};
+
+/*
+ * A catalog being served.
+ * The file is checked for changes on each request for it.
+ * Reloads are numbered so that a slow reload doesn't replace the
+ * dictionary of a later one that finished first.
+ */
+struct	srvcat {
+	pthread_mutex_t	      mutex; /* protects all but name */
+	const struct catname *name; /* catalog file */
+	struct loaded	     *cur; /* current dictionary */
+	struct stat	      st; /* file when last loaded (or tried) */
+	size_t		      gen; /* reloads started */
+	size_t		      curgen; /* reload of cur */
+};
+
+/*
+ * State shared by all connections.
+ */
+struct	server {
+	const struct opts *opts; /* command-line options */
+	struct srvcat	  *cats; /* served catalogs */
+	size_t		   catsz; /* number of catalogs */
+	pthread_mutex_t	   mutex; /* protects conns */
+	pthread_cond_t	   cond; /* signalled when conns drops */
+	size_t		   conns; /* requests being served */
+	size_t		   connmax; /* most requests served at once */
+};
+
+/*
+ * A client connection.
+ */
+struct	conn {
+	struct server	*srv; /* server */
+	int		 fd; /* socket */
+};
+
+/*
+ * Whether the file backing a loaded dictionary has been replaced or
+ * modified since.
+ */
+static int
+stat_changed(const struct stat *a, const struct stat *b)
+{
+
+	return a->st_dev != b->st_dev ||
+		a->st_ino != b->st_ino ||
+		a->st_size != b->st_size ||
+		a->st_mtime != b->st_mtime;
+}
+
+/*
+ * Drop a reference to "l", freeing it if it was the last.
+ * Must be called with the owning catalog locked.
+ */
+static void
+loaded_release(struct loaded *l)
+{
+
+	assert(l->refs > 0);
+	if (--l->refs > 0)
+		return;
+	xparse_free(l->xp);
+	free(l);
+}
+
+/*
+ * Get a reference to the current dictionary of "sc", first reloading
+ * it with "p" if its file has changed.
+ * The reload is done unlocked, so other requests keep using the
+ * previous dictionary meanwhile, and only swapped in once loaded.
+ * If the reload fails, the previous dictionary is kept; it's tried
+ * again once the file changes again.
+ */
+static struct loaded *
+srvcat_get(struct srvcat *sc, XML_Parser p)
+{
+	struct stat	 st;
+	struct xparse	*xp;
+	struct loaded	*l;
+	size_t		 gen;
+
+	pthread_mutex_lock(&sc->mutex);
+
+	if (-1 == stat(sc->name->fname, &st) ||
+	    ! stat_changed(&st, &sc->st)) {
+		l = sc->cur;
+		l->refs++;
+		pthread_mutex_unlock(&sc->mutex);
+		return l;
+	}
+
+	sc->st = st;
+	gen = ++sc->gen;
+	pthread_mutex_unlock(&sc->mutex);
+
+	if (NULL != (xp = catalog_load(sc->name, p, 1))) {
+		if (NULL == (l = calloc(1, sizeof(struct loaded))))
+			err(EXIT_FAILURE, NULL);
+		l->xp = xp;
+		l->refs = 1;
+	} else
+		warnx("%s: keeping previous catalog", sc->name->fname);
+
+	pthread_mutex_lock(&sc->mutex);
+	if (NULL != xp && gen > sc->curgen) {
+		loaded_release(sc->cur);
+		sc->cur = l;
+		sc->curgen = gen;
+	} else if (NULL != xp)
+		loaded_release(l);
+	l = sc->cur;
+	l->refs++;
+	pthread_mutex_unlock(&sc->mutex);
+	return l;
+}
+
+static void
+srvcat_put(struct srvcat *sc, struct loaded *l)
+{
+
+	pthread_mutex_lock(&sc->mutex);
+	loaded_release(l);
+	pthread_mutex_unlock(&sc->mutex);
+}
+
+/*
+ * Find the catalog whose target language is "lang" (or the first, if
+ * "lang" is empty) and get a reference to its dictionary.
+ * Returns NULL if there's no such catalog.
+ */
+static struct loaded *
+srv_lookup(struct server *srv, const char *lang,
+	XML_Parser p, struct srvcat **scp)
+{
+	size_t		 i;
+	struct loaded	*l;
+
+	for (i = 0; i < srv->catsz; i++) {
+		l = srvcat_get(&srv->cats[i], p);
+		if ('\0' == *lang || (NULL != l->xp->trglang &&
+		    0 == strcasecmp(l->xp->trglang, lang))) {
+			*scp = &srv->cats[i];
+			return l;
+		}
+		srvcat_put(&srv->cats[i], l);
+	}
+
+	return NULL;
+}
+
+/*
+ * Read the whole request (until the client shuts down writing) into
+ * "b".
+ * Returns zero on failure or -1 if the request exceeds REQ_MAX.
+ */
+static int
+conn_read(int fd, struct buf *b)
+{
+	char	 in[16 * 1024];
+	ssize_t	 sz;
+
+	for (;;) {
+		if (-1 == (sz = read(fd, in, sizeof(in)))) {
+			if (EINTR == errno)
+				continue;
+			return 0;
+		} else if (0 == sz)
+			return 1;
+		if ((size_t)sz > REQ_MAX - b->sz)
+			return -1;
+		buf_append(b, in, sz);
+	}
+}
+
+/*
+ * Serve a single request: a line with the target language, then the
+ * document to translate.
+ * Responds with a status line, then the translated document if the
+ * status is "ok".
+ */
+static void *
+conn_worker(void *arg)
+{
+	struct conn	*c = arg;
+	struct server	*srv = c->srv;
+	struct buf	 req;
+	struct sink	 out, res;
+	struct srvcat	*sc;
+	struct loaded	*l = NULL;
+	XML_Parser	 p;
+	char		*doc;
+	const char	*er = NULL;
+	int		 rc;
+
+	if (NULL == (p = XML_ParserCreate(NULL)))
+		errx(EXIT_FAILURE, "XML_ParserCreate");
+
+	memset(&req, 0, sizeof(struct buf));
+	sink_init(&out, -1);
+	sink_init(&res, c->fd);
+
+	if (0 == (rc = conn_read(c->fd, &req))) {
+		if (EAGAIN == errno || EWOULDBLOCK == errno)
+			warnx("<socket>: request timed out");
+		else
+			warn("<socket>");
+		goto out;
+	}
+
+	if (-1 == rc)
+		er = "request too large";
+	else if (NULL == req.b ||
+	    NULL == (doc = memchr(req.b, '\n', req.sz)))
+		er = "no language line";
+	else {
+		*doc++ = '\0';
+		if (NULL == (l = srv_lookup(srv, req.b, p, &sc)))
+			er = "unknown language";
+		else if ( ! join_doc(p, srv->opts, l->xp, "<socket>",
+		    doc, req.sz - (doc - req.b), &out))
+			er = "translation failed";
+	}
+
+	if (NULL != l)
+		srvcat_put(sc, l);
+
+	if (NULL != er) {
+		sink_puts(&res, "error: ");
+		sink_puts(&res, er);
+		sink_putc(&res, '\n');
+	} else {
+		sink_puts(&res, "ok\n");
+		sink_write(&res, out.buf.b, out.buf.sz);
+	}
+
+	/* The client may have gone away. */
+
+	if ( ! sink_flush(&res) && EPIPE != errno)
+		warn("<socket>");
+out:
+	close(c->fd);
+	sink_free(&res);
+	sink_free(&out);
+	buf_free(&req);
+	XML_ParserFree(p);
+	free(c);
+
+	pthread_mutex_lock(&srv->mutex);
+	srv->conns--;
+	pthread_cond_signal(&srv->cond);
+	pthread_mutex_unlock(&srv->mutex);
+	return NULL;
+}
+
+/*
+ * Open a listening socket on "path", replacing any stale socket.
+ * Returns -1 on failure (after reporting the error).
+ */
+static int
+srv_listen(const char *path)
+{
+	struct sockaddr_un	 sun;
+	struct stat		 st;
+	int			 fd;
+
+	memset(&sun, 0, sizeof(struct sockaddr_un));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		warnx("%s: socket path too long", path);
+		return -1;
+	}
+
+	if (-1 != lstat(path, &st) && S_ISSOCK(st.st_mode) &&
+	    -1 == unlink(path)) {
+		warn("%s", path);
+		return -1;
+	}
+
+	if (-1 == (fd = socket(AF_UNIX, SOCK_STREAM, 0))) {
+		warn("socket");
+		return -1;
+	}
+
+	if (-1 == bind(fd, (struct sockaddr *)&sun, sizeof(sun)) ||
+	    -1 == listen(fd, SOMAXCONN)) {
+		warn("%s", path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Serve translations with the dictionaries in "cats" on the socket
+ * "path", each connection in its own thread.
+ * Once the most connections are being served, further ones wait to
+ * be accepted until one finishes.
+ * This only returns on failure.
+ */
+int
+serve(const struct catname *cats, size_t catsz, XML_Parser p,
+	const struct opts *o, const char *path)
+{
+	struct server	 srv;
+	struct srvcat	*sc;
+	struct conn	*c;
+	struct timeval	 tv;
+	pthread_t	 tid;
+	pthread_attr_t	 attr;
+	size_t		 i;
+	int		 fd, cfd, er;
+
+	assert(catsz > 0);
+
+	memset(&srv, 0, sizeof(struct server));
+	srv.opts = o;
+	srv.connmax = 0 == o->jobs ? CONN_MAX : o->jobs;
+	if (0 != (er = pthread_mutex_init(&srv.mutex, NULL)))
+		errc(EXIT_FAILURE, er, "pthread_mutex_init");
+	if (0 != (er = pthread_cond_init(&srv.cond, NULL)))
+		errc(EXIT_FAILURE, er, "pthread_cond_init");
+	srv.cats = calloc(catsz, sizeof(struct srvcat));
+	if (NULL == srv.cats)
+		err(EXIT_FAILURE, NULL);
+
+	/* Load everything up front so errors are seen immediately. */
+
+	for (i = 0; i < catsz; i++) {
+		sc = &srv.cats[i];
+		sc->name = &cats[i];
+		if (-1 == stat(cats[i].fname, &sc->st)) {
+			warn("%s", cats[i].fname);
+			return 0;
+		}
+		if (NULL == (sc->cur = calloc(1, sizeof(struct loaded))))
+			err(EXIT_FAILURE, NULL);
+		if (NULL == (sc->cur->xp = catalog_load(&cats[i], p, 1)))
+			return 0;
+		sc->cur->refs = 1;
+		if (0 != (er = pthread_mutex_init(&sc->mutex, NULL)))
+			errc(EXIT_FAILURE, er, "pthread_mutex_init");
+		srv.catsz++;
+	}
+
+	if (-1 == (fd = srv_listen(path)))
+		return 0;
+
+	/* Clients going away shouldn't take us with them. */
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (0 != (er = pthread_attr_init(&attr)) ||
+	    0 != (er = pthread_attr_setdetachstate
+	     (&attr, PTHREAD_CREATE_DETACHED)))
+		errc(EXIT_FAILURE, er, "pthread_attr");
+
+	for (;;) {
+		pthread_mutex_lock(&srv.mutex);
+		while (srv.conns >= srv.connmax)
+			pthread_cond_wait(&srv.cond, &srv.mutex);
+		pthread_mutex_unlock(&srv.mutex);
+
+		if (-1 == (cfd = accept(fd, NULL, NULL))) {
+			if (EINTR == errno || ECONNABORTED == errno)
+				continue;
+			warn("accept");
+			break;
+		}
+
+		/* Idle clients mustn't hold a connection forever. */
+
+		tv.tv_sec = CONN_TIMEOUT;
+		tv.tv_usec = 0;
+		if (-1 == setsockopt(cfd, SOL_SOCKET,
+		     SO_RCVTIMEO, &tv, sizeof(tv)) ||
+		    -1 == setsockopt(cfd, SOL_SOCKET,
+		     SO_SNDTIMEO, &tv, sizeof(tv))) {
+			warn("setsockopt");
+			close(cfd);
+			continue;
+		}
+
+		if (NULL == (c = calloc(1, sizeof(struct conn))))
+			err(EXIT_FAILURE, NULL);
+		c->srv = &srv;
+		c->fd = cfd;
+
+		pthread_mutex_lock(&srv.mutex);
+		srv.conns++;
+		pthread_mutex_unlock(&srv.mutex);
+
+		if (0 != (er = pthread_create
+		    (&tid, &attr, conn_worker, c))) {
+			warnc(er, "pthread_create");
+			close(cfd);
+			free(c);
+			pthread_mutex_lock(&srv.mutex);
+			srv.conns--;
+			pthread_mutex_unlock(&srv.mutex);
+		}
+	}
+
+	/* Connections may still be running: leave the catalogs be. */
+
+	pthread_attr_destroy(&attr);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,172 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <expat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+/*
+ * Output is written out once this much is buffered.
+ */
+#define	SINK_BUFSZ	(64 * 1024)
+
+/*
+ * Initialise "s" to write into "fd", or into memory if it's -1.
+ */
+void
+sink_init(struct sink *s, int fd)
+{
+
+	memset(s, 0, sizeof(struct sink));
+	s->fd = fd;
+}
+
+/*
+ * Write all of "iov", retrying on short writes.
+ * Returns zero on failure (with errno set), non-zero on success.
+ */
+static int
+sink_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t	 sz;
+
+	while (iovcnt > 0) {
+		if (-1 == (sz = writev(fd, iov, iovcnt))) {
+			if (EINTR == errno)
+				continue;
+			return 0;
+		}
+		for ( ; iovcnt > 0 && (size_t)sz >= iov->iov_len; iovcnt--)
+			sz -= iov++->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + sz;
+			iov->iov_len -= sz;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Append "len" bytes of "p".
+ * If this would overflow the buffer, write the buffer out first; or if
+ * "p" is itself large, write it out along with the buffer.
+ * Once a write has failed, output is discarded.
+ */
+void
+sink_write(struct sink *s, const char *p, size_t len)
+{
+	struct iovec	 iov[2];
+
+	if (-1 == s->fd || s->buf.sz + len <= SINK_BUFSZ) {
+		buf_append(&s->buf, p, len);
+		return;
+	}
+
+	if (0 != s->er)
+		return;
+
+	iov[0].iov_base = s->buf.b;
+	iov[0].iov_len = s->buf.sz;
+
+	if (len < SINK_BUFSZ) {
+		if ( ! sink_writev(s->fd, iov, 1))
+			s->er = errno;
+		s->buf.sz = 0;
+		buf_append(&s->buf, p, len);
+		return;
+	}
+
+	iov[1].iov_base = (void *)p;
+	iov[1].iov_len = len;
+	if ( ! sink_writev(s->fd, iov, 2))
+		s->er = errno;
+	s->buf.sz = 0;
+}
+
+void
+sink_puts(struct sink *s, const char *p)
+{
+
+	sink_write(s, p, strlen(p));
+}
+
+void
+sink_putc(struct sink *s, char c)
+{
+
+	sink_write(s, &c, 1);
+}
+
+/*
+ * Append an attribute as ` key="val"'.
+ */
+void
+sink_attr(struct sink *s, const char *key, const char *val)
+{
+
+	sink_putc(s, ' ');
+	sink_puts(s, key);
+	sink_write(s, "=\"", 2);
+	sink_puts(s, val);
+	sink_putc(s, '"');
+}
+
+/*
+ * Write out any buffered output.
+ * Returns zero if this or any prior write failed (with errno set).
+ */
+int
+sink_flush(struct sink *s)
+{
+	struct iovec	 iov;
+
+	if (-1 != s->fd && 0 == s->er && s->buf.sz > 0) {
+		iov.iov_base = s->buf.b;
+		iov.iov_len = s->buf.sz;
+		if ( ! sink_writev(s->fd, &iov, 1))
+			s->er = errno;
+	}
+
+	if (-1 != s->fd)
+		s->buf.sz = 0;
+
+	if (0 == s->er)
+		return 1;
+
+	errno = s->er;
+	return 0;
+}
+
+/*
+ * Free the buffer, but not the descriptor.
+ */
+void
+sink_free(struct sink *s)
+{
+
+	buf_free(&s->buf);
+}
@@ -0,0 +1,338 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <expat.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extern.h"
+
+/*
+ * When scanned words exceed their budget, they're sorted and written
+ * to a temporary file as a run, then forgotten.
+ * Once scanning is done, the runs are merged with a heap ordered by
+ * each run's current word, combining words found in more than one.
+ * Each word in a run is its line, column, count, and source length as
+ * size_t, then the source.
+ * Runs are only read by this process, so needn't be portable.
+ *
+ * Each run holds a file open, so there may only be so many: when
+ * there are too many, the smaller half are merged into a new run.
+ */
+
+/*
+ * Append the word "w" to the run "r".
+ */
+static void
+run_write(struct wordrun *r, const struct word *w)
+{
+	size_t	 hdr[4];
+
+	hdr[0] = w->line;
+	hdr[1] = w->col;
+	hdr[2] = w->count;
+	hdr[3] = strlen(w->source);
+	fwrite(hdr, sizeof(size_t), 4, r->f);
+	fwrite(w->source, 1, hdr[3], r->f);
+	r->size += sizeof(hdr) + hdr[3];
+}
+
+/*
+ * Read the next word of "r" as its current word.
+ * Returns zero at the end of the run.
+ */
+static int
+run_read(struct wordrun *r)
+{
+	size_t	 hdr[4];
+
+	if (4 != fread(hdr, sizeof(size_t), 4, r->f)) {
+		if (ferror(r->f))
+			err(EXIT_FAILURE, "tmpfile");
+		return 0;
+	}
+
+	if (hdr[3] + 1 > r->max) {
+		r->max = hdr[3] + 1;
+		free(r->w.source);
+		if (NULL == (r->w.source = malloc(r->max)))
+			err(EXIT_FAILURE, NULL);
+	}
+
+	if (hdr[3] != fread(r->w.source, 1, hdr[3], r->f))
+		errx(EXIT_FAILURE, "tmpfile: short read");
+
+	r->w.source[hdr[3]] = '\0';
+	r->w.line = hdr[0];
+	r->w.col = hdr[1];
+	r->w.count = hdr[2];
+	return 1;
+}
+
+static void
+run_free(struct wordrun *r)
+{
+
+	fclose(r->f);
+	free(r->w.source);
+}
+
+/*
+ * Restore the heap order of the "sz" runs "r" from "i" downward.
+ */
+static void
+runs_sift(struct wordrun *r, size_t sz, size_t i)
+{
+	struct wordrun	 tmp;
+	size_t		 c;
+
+	while ((c = 2 * i + 1) < sz) {
+		if (c + 1 < sz && strcmp
+		    (r[c + 1].w.source, r[c].w.source) < 0)
+			c++;
+		if (strcmp(r[c].w.source, r[i].w.source) >= 0)
+			break;
+		tmp = r[i];
+		r[i] = r[c];
+		r[c] = tmp;
+		i = c;
+	}
+}
+
+/*
+ * Advance the run at the top of the heap, dropping it when done.
+ */
+static void
+runs_next(struct wordrun *r, size_t *sz)
+{
+
+	if ( ! run_read(&r[0])) {
+		run_free(&r[0]);
+		r[0] = r[--*sz];
+	}
+	runs_sift(r, *sz, 0);
+}
+
+/*
+ * Rewind the runs "r" and order them as a heap by their first words,
+ * dropping those that are empty.
+ */
+static void
+runs_start(struct wordrun *r, size_t *sz)
+{
+	size_t	 i;
+
+	for (i = 0; i < *sz; ) {
+		rewind(r[i].f);
+		if (run_read(&r[i])) {
+			i++;
+			continue;
+		}
+		run_free(&r[i]);
+		r[i] = r[--*sz];
+	}
+
+	for (i = *sz / 2; i > 0; i--)
+		runs_sift(r, *sz, i - 1);
+}
+
+/*
+ * Take the next word from the heap of runs "r" into "w", whose source
+ * buffer is "max" bytes, combining it with the same word in others.
+ * Returns zero if there are no more.
+ */
+static int
+runs_pop(struct wordrun *r, size_t *sz, struct word *w, size_t *max)
+{
+	size_t	 len;
+
+	if (0 == *sz)
+		return 0;
+
+	len = strlen(r[0].w.source) + 1;
+	if (len > *max) {
+		*max = len;
+		free(w->source);
+		if (NULL == (w->source = malloc(len)))
+			err(EXIT_FAILURE, NULL);
+	}
+
+	memcpy(w->source, r[0].w.source, len);
+	w->line = r[0].w.line;
+	w->col = r[0].w.col;
+	w->count = r[0].w.count;
+	runs_next(r, sz);
+
+	while (*sz > 0 && 0 == strcmp(r[0].w.source, w->source)) {
+		word_seen(w, r[0].w.line, r[0].w.col, r[0].w.count);
+		runs_next(r, sz);
+	}
+
+	return 1;
+}
+
+/*
+ * Order runs by decreasing size.
+ */
+static int
+run_cmp(const void *a, const void *b)
+{
+	const struct wordrun *r1 = a, *r2 = b;
+
+	return r1->size < r2->size ? 1 : r1->size > r2->size ? -1 : 0;
+}
+
+/*
+ * Start a new, empty run at the end of those of "hp".
+ * If there are already too many runs, first merge the smaller half
+ * into one.
+ */
+static struct wordrun *
+runs_add(struct hparse *hp)
+{
+	struct wordrun	 r, *tail;
+	struct word	 w;
+	size_t		 sz, wmax = 0;
+
+	if (hp->runsz >= hp->runmax && hp->runsz > 1) {
+		sz = hp->runsz / 2 > 1 ? hp->runsz / 2 : 2;
+		qsort(hp->runs, hp->runsz,
+			sizeof(struct wordrun), run_cmp);
+		tail = &hp->runs[hp->runsz - sz];
+		hp->runsz -= sz;
+
+		memset(&r, 0, sizeof(struct wordrun));
+		memset(&w, 0, sizeof(struct word));
+		if (NULL == (r.f = tmpfile()))
+			err(EXIT_FAILURE, "tmpfile");
+		runs_start(tail, &sz);
+		while (runs_pop(tail, &sz, &w, &wmax))
+			run_write(&r, &w);
+		free(w.source);
+		if (EOF == fflush(r.f) || ferror(r.f))
+			err(EXIT_FAILURE, "tmpfile");
+		hp->runs[hp->runsz++] = r;
+	}
+
+	hp->runs = reallocarray(hp->runs,
+		hp->runsz + 1, sizeof(struct wordrun));
+	if (NULL == hp->runs)
+		err(EXIT_FAILURE, NULL);
+	tail = &hp->runs[hp->runsz++];
+	memset(tail, 0, sizeof(struct wordrun));
+	return tail;
+}
+
+/*
+ * Write the words of "hp", which is emptied, as a new run.
+ */
+void
+spill(struct hparse *hp)
+{
+	struct wordrun	*r;
+	size_t		 i;
+
+	if (0 == hp->words.sz)
+		return;
+
+	r = runs_add(hp);
+	if (NULL == (r->f = tmpfile()))
+		err(EXIT_FAILURE, "tmpfile");
+
+	words_sort(hp);
+	for (i = 0; i < hp->words.sz; i++)
+		run_write(r, &hp->words.w[i]);
+	if (EOF == fflush(r->f) || ferror(r->f))
+		err(EXIT_FAILURE, "tmpfile");
+
+	hp->spills++;
+	wordset_free(&hp->words);
+}
+
+/*
+ * Spill the words of "src" and move all of its runs into "dst".
+ */
+void
+spill_move(struct hparse *dst, struct hparse *src)
+{
+	size_t	 i;
+
+	spill(src);
+	for (i = 0; i < src->runsz; i++)
+		*runs_add(dst) = src->runs[i];
+	dst->spills += src->spills;
+	free(src->runs);
+	src->runs = NULL;
+	src->runsz = 0;
+}
+
+/*
+ * Ready the words of "hp" for words_next(): either sort them (unless
+ * already sorted, i.e., no longer indexed) or, if any have been
+ * spilled, spill the rest and start merging the runs.
+ */
+void
+words_finish(struct hparse *hp)
+{
+
+	hp->next = 0;
+
+	if (0 == hp->runsz) {
+		if (NULL != hp->words.idx.slot)
+			words_sort(hp);
+		return;
+	}
+
+	spill(hp);
+	runs_start(hp->runs, &hp->runsz);
+}
+
+/*
+ * Return the next word of "hp" in sorted order or NULL if there are no
+ * more, after words_finish().
+ * The word is only valid until the next call.
+ */
+const struct word *
+words_next(struct hparse *hp)
+{
+
+	if (0 == hp->runsz)
+		return hp->next < hp->words.sz ?
+			&hp->words.w[hp->next++] : NULL;
+
+	return runs_pop(hp->runs, &hp->runsz, &hp->cur, &hp->curmax) ?
+		&hp->cur : NULL;
+}
+
+void
+spill_free(struct hparse *hp)
+{
+	size_t	 i;
+
+	for (i = 0; i < hp->runsz; i++)
+		run_free(&hp->runs[i]);
+	free(hp->runs);
+	free(hp->cur.source);
+	hp->runs = NULL;
+	hp->runsz = 0;
+}
@@ -0,0 +1,429 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#if HAVE_ERR
+# include <err.h>
+#endif
+#include <errno.h>
+#include <expat.h>
+#include <fnmatch.h>
+#if HAVE_FTS
+# include <fts.h>
+#endif
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extern.h"
+
+/*
+ * Input files: those given on the command line, then those found by
+ * walking the directories of -R.
+ * The walk happens in its own thread so that files may be parsed as
+ * they're found.
+ * Files are named in a fixed order (the arguments, then the walk in
+ * lexicographic order), so output is as if they'd all been given.
+ * Output files written for inputs are also tracked here, so that no
+ * two inputs write the same one.
+ */
+struct	input {
+	char		 *name; /* file name */
+	size_t		  sub; /* start of path within its -R dir */
+};
+
+struct	inputs {
+	pthread_mutex_t	  mutex; /* protects all but opts and tid */
+	pthread_cond_t	  cond; /* signalled when names are added */
+	const struct opts *opts; /* command-line options */
+	pthread_t	  tid; /* walker, if walking */
+	int		  walk; /* whether walking */
+	struct input	 *ins; /* input files */
+	size_t		  insz; /* number of inputs */
+	size_t		  inmax; /* ins buffer size */
+	int		  done; /* whether all names are known */
+	int		  stop; /* whether to stop walking */
+	int		  rc; /* whether walk succeeded */
+	char		**outs; /* output files claimed */
+	const char	**owners; /* input of each output */
+	size_t		  outsz; /* number of outputs */
+	size_t		  outmax; /* outs and owners buffer size */
+	struct slots	  outidx; /* index into outs */
+};
+
+/*
+ * An output file being looked up.
+ */
+struct	outkey {
+	const struct inputs *in;
+	const char	    *path;
+};
+
+/*
+ * Files walked if -I isn't given.
+ */
+static const char *const incs[] = {
+	"*.html",
+	"*.htm",
+	"*.xhtml",
+};
+
+/*
+ * Add the file "name" to "in", whose path within its -R directory
+ * starts at "sub".
+ * Must be called with "in" locked.
+ */
+static void
+inputs_add(struct inputs *in, const char *name, size_t sub)
+{
+	struct input	*ip;
+
+	if (in->insz == in->inmax) {
+		in->inmax = 0 == in->inmax ? 64 : in->inmax * 2;
+		in->ins = reallocarray(in->ins,
+			in->inmax, sizeof(struct input));
+		if (NULL == in->ins)
+			err(EXIT_FAILURE, NULL);
+	}
+	ip = &in->ins[in->insz++];
+	if (NULL == (ip->name = strdup(name)))
+		err(EXIT_FAILURE, NULL);
+	ip->sub = sub;
+}
+
+/*
+ * Where the path of "name" within its -R directory starts: as with
+ * files given as arguments, that's the file name itself.
+ */
+static size_t
+basename_off(const char *name)
+{
+	const char	*cp;
+
+	return NULL == (cp = strrchr(name, '/')) ? 0 : cp - name + 1;
+}
+
+/*
+ * Whether "name" matches any of the "pats" globs.
+ */
+static int
+match(const char *const *pats, size_t patsz, const char *name)
+{
+	size_t	 i;
+
+	for (i = 0; i < patsz; i++)
+		if (0 == fnmatch(pats[i], name, 0))
+			return 1;
+	return 0;
+}
+
+static int
+walk_cmp(const FTSENT **a, const FTSENT **b)
+{
+
+	return strcmp((*a)->fts_name, (*b)->fts_name);
+}
+
+/*
+ * Walk the directories of -R, adding regular files that match -I (or
+ * look like HTML, if not given) and not -X.
+ * Directories matching -X aren't entered.
+ * Errors stop the walk, as does the walk no longer being wanted.
+ */
+static void *
+walk(void *arg)
+{
+	struct inputs	 *in = arg;
+	const struct opts *o = in->opts;
+	FTS		 *fts;
+	FTSENT		 *ent, *top;
+	char		**dirs;
+	const char *const *inc;
+	size_t		  i, incsz;
+	int		  rc = 1;
+
+	inc = o->incsz > 0 ? o->incs : incs;
+	incsz = o->incsz > 0 ? o->incsz : sizeof(incs) / sizeof(incs[0]);
+
+	if (NULL == (dirs = calloc(o->dirsz + 1, sizeof(char *))))
+		err(EXIT_FAILURE, NULL);
+	for (i = 0; i < o->dirsz; i++)
+		dirs[i] = (char *)o->dirs[i];
+
+	if (NULL == (fts = fts_open(dirs,
+	    FTS_PHYSICAL | FTS_NOCHDIR, walk_cmp))) {
+		warn("fts_open");
+		rc = 0;
+	}
+
+	while (rc) {
+		errno = 0;
+		if (NULL == (ent = fts_read(fts))) {
+			if (0 != errno) {
+				warn("fts_read");
+				rc = 0;
+			}
+			break;
+		}
+
+		pthread_mutex_lock(&in->mutex);
+		if (in->stop)
+			rc = 0;
+		pthread_mutex_unlock(&in->mutex);
+		if ( ! rc)
+			break;
+
+		switch (ent->fts_info) {
+		case FTS_D:
+			if (ent->fts_level > 0 &&
+			    match(o->excs, o->excsz, ent->fts_name))
+				fts_set(fts, ent, FTS_SKIP);
+			continue;
+		case FTS_F:
+			break;
+		case FTS_DNR:
+		case FTS_ERR:
+		case FTS_NS:
+			warnc(ent->fts_errno, "%s", ent->fts_path);
+			rc = 0;
+			continue;
+		default:
+			continue;
+		}
+
+		if ( ! match(inc, incsz, ent->fts_name) ||
+		    match(o->excs, o->excsz, ent->fts_name))
+			continue;
+
+		/* Find the entry just below the -R directory. */
+
+		for (top = ent; top->fts_level > 1; top = top->fts_parent)
+			continue;
+
+		pthread_mutex_lock(&in->mutex);
+		inputs_add(in, ent->fts_path, 0 == ent->fts_level ?
+			basename_off(ent->fts_path) :
+			top->fts_pathlen - top->fts_namelen);
+		pthread_cond_broadcast(&in->cond);
+		pthread_mutex_unlock(&in->mutex);
+	}
+
+	if (NULL != fts)
+		fts_close(fts);
+	free(dirs);
+
+	pthread_mutex_lock(&in->mutex);
+	in->done = 1;
+	if ( ! in->stop)
+		in->rc = rc;
+	pthread_cond_broadcast(&in->cond);
+	pthread_mutex_unlock(&in->mutex);
+	return NULL;
+}
+
+/*
+ * Collect the input files named in "argv" and start walking the
+ * directories of -R, if any.
+ * Returns NULL if there are no inputs at all, i.e., standard input is
+ * to be read.
+ */
+struct inputs *
+inputs_alloc(const struct opts *o, int argc, char *argv[])
+{
+	struct inputs	*in;
+	int		 i, er;
+
+	if (0 == argc && 0 == o->dirsz)
+		return NULL;
+
+	if (NULL == (in = calloc(1, sizeof(struct inputs))))
+		err(EXIT_FAILURE, NULL);
+
+	in->opts = o;
+	in->rc = 1;
+	for (i = 0; i < argc; i++)
+		inputs_add(in, argv[i], basename_off(argv[i]));
+
+	if (0 != (er = pthread_mutex_init(&in->mutex, NULL)))
+		errc(EXIT_FAILURE, er, "pthread_mutex_init");
+	if (0 != (er = pthread_cond_init(&in->cond, NULL)))
+		errc(EXIT_FAILURE, er, "pthread_cond_init");
+
+	if (0 == o->dirsz) {
+		in->done = 1;
+		return in;
+	}
+
+	if (0 != (er = pthread_create(&in->tid, NULL, walk, in)))
+		errc(EXIT_FAILURE, er, "pthread_create");
+	in->walk = 1;
+	return in;
+}
+
+/*
+ * Number of workers worth having for "in", at most "jobs".
+ * While walking, the number of inputs isn't known.
+ */
+size_t
+inputs_jobs(const struct inputs *in, size_t jobs)
+{
+
+	if (NULL == in)
+		return 1;
+	if (in->walk || in->insz > jobs)
+		return jobs;
+	return in->insz > 0 ? in->insz : 1;
+}
+
+/*
+ * Get the name of input "i", waiting for it to be found if need be.
+ * If "sub" is not NULL, it's set to the input's path within its -R
+ * directory, or its file name if not walked.
+ * Returns NULL if there's no such input.
+ */
+const char *
+inputs_get(struct inputs *in, size_t i, const char **sub)
+{
+	const struct input *ip = NULL;
+
+	if (in->walk) {
+		pthread_mutex_lock(&in->mutex);
+		while (i >= in->insz && ! in->done)
+			pthread_cond_wait(&in->cond, &in->mutex);
+		if (i < in->insz)
+			ip = &in->ins[i];
+		pthread_mutex_unlock(&in->mutex);
+	} else if (i < in->insz)
+		ip = &in->ins[i];
+
+	if (NULL == ip)
+		return NULL;
+	if (NULL != sub)
+		*sub = ip->name + ip->sub;
+	return ip->name;
+}
+
+static int
+outs_eq(const void *arg, size_t i)
+{
+	const struct outkey *k = arg;
+
+	return 0 == strcmp(k->in->outs[i], k->path);
+}
+
+static uint64_t
+outs_hash(const void *arg, size_t i)
+{
+	const struct inputs *in = arg;
+
+	return key_hash(0, in->outs[i], strlen(in->outs[i]));
+}
+
+/*
+ * Claim the output file "path" for the input "name".
+ * Returns zero if it's already been claimed by another input (after
+ * reporting it).
+ */
+int
+inputs_claim(struct inputs *in, const char *path, const char *name)
+{
+	struct outkey	 k;
+	size_t		 j;
+	int		 rc = 1;
+
+	k.in = in;
+	k.path = path;
+
+	pthread_mutex_lock(&in->mutex);
+
+	slots_reserve(&in->outidx, in->outsz + 1, 6, outs_hash, in);
+	j = slots_find(in->outidx.slot, in->outidx.bits,
+		key_hash(0, path, strlen(path)), outs_eq, &k, NULL);
+	assert(SIZE_MAX != j);
+
+	if (0 != in->outidx.slot[j]) {
+		fprintf(stderr, "%s: also output for %s\n", path,
+			in->owners[in->outidx.slot[j] - 1]);
+		rc = 0;
+	} else {
+		if (in->outsz == in->outmax) {
+			in->outmax = 0 == in->outmax ? 64 : in->outmax * 2;
+			in->outs = reallocarray(in->outs,
+				in->outmax, sizeof(char *));
+			in->owners = reallocarray(in->owners,
+				in->outmax, sizeof(char *));
+			if (NULL == in->outs || NULL == in->owners)
+				err(EXIT_FAILURE, NULL);
+		}
+		if (NULL == (in->outs[in->outsz] = strdup(path)))
+			err(EXIT_FAILURE, NULL);
+		in->owners[in->outsz] = name;
+		in->outidx.slot[j] = ++in->outsz;
+	}
+
+	pthread_mutex_unlock(&in->mutex);
+	return rc;
+}
+
+/*
+ * Stop walking, if still walking, and wait for the walk to finish.
+ * This may be called more than once.
+ * Returns zero if the walk failed.
+ */
+int
+inputs_finish(struct inputs *in)
+{
+	int	 er;
+
+	if ( ! in->walk)
+		return in->rc;
+
+	pthread_mutex_lock(&in->mutex);
+	in->stop = 1;
+	pthread_mutex_unlock(&in->mutex);
+	if (0 != (er = pthread_join(in->tid, NULL)))
+		errc(EXIT_FAILURE, er, "pthread_join");
+	in->walk = 0;
+	return in->rc;
+}
+
+void
+inputs_free(struct inputs *in)
+{
+	size_t	 i;
+
+	if (NULL == in)
+		return;
+	inputs_finish(in);
+	pthread_mutex_destroy(&in->mutex);
+	pthread_cond_destroy(&in->cond);
+	for (i = 0; i < in->insz; i++)
+		free(in->ins[i].name);
+	for (i = 0; i < in->outsz; i++)
+		free(in->outs[i]);
+	free(in->ins);
+	free(in->outs);
+	free(in->owners);
+	slots_free(&in->outidx);
+	free(in);
+}